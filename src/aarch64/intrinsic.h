@@ -65,11 +65,13 @@ static ALWAYS_INLINE u64 get_clock_frequency()
     return result;
 }
 
+// 获取当前时间戳 (时钟周期)
+// 读取虚拟计数器CNTVCT, 与虚拟定时器的比较值CNTV_CVAL处于同一时间基准
 static ALWAYS_INLINE u64 get_timestamp()
 {
     u64 result;
     compiler_fence();
-    asm volatile("mrs %[cnt], cntpct_el0" : [cnt] "=r"(result));
+    asm volatile("mrs %[cnt], cntvct_el0" : [cnt] "=r"(result));
     compiler_fence();
     return result;
 }
@@ -259,6 +261,11 @@ static ALWAYS_INLINE void set_cntv_tval_el0(u64 t)
     asm volatile("msr cntv_tval_el0, %0" : : "r"(t));
 }
 
+static ALWAYS_INLINE void set_cntv_cval_el0(u64 c)
+{
+    asm volatile("msr cntv_cval_el0, %0" : : "r"(c));
+}
+
 // 启用trap
 // 如果trap之前是开启的, 则返回true
 // 如果trap之前是关闭的, 则返回false
@@ -302,4 +309,4 @@ static ALWAYS_INLINE NO_RETURN void arch_stop_cpu()
 
 void delay_us(u64 n);
 u64 psci_cpu_on(u64 cpuid, u64 ep);
-void smp_init();
\ No newline at end of file
+void smp_init();
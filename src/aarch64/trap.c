@@ -48,6 +48,9 @@ void trap_global_handler(UserContext* context)
         }
     }
 
+    // 有应当抢占当前进程的进程被唤醒, 在返回前让出CPU
+    check_resched();
+
     // 如果进程有终止标志，且即将返回到用户态 则执行exit(-1)
     auto spsr_mode = context->spsr_el1 & 0xF;
     if (p->killed && spsr_mode == 0)
@@ -338,4 +338,23 @@ rb_node _rb_first(rb_root root)
         n = n->rb_left;
 
     return n;
-}
\ No newline at end of file
+}
+
+// 获取结点的中序后继, 没有则返回NULL
+rb_node _rb_next(rb_node node)
+{
+    // 如果有右子树, 则返回右子树的最左侧结点
+    if (node->rb_right) {
+        node = node->rb_right;
+        while (node->rb_left)
+            node = node->rb_left;
+        return node;
+    }
+
+    // 否则向上找到第一个 自己位于其左子树中的祖先
+    rb_node parent;
+    while ((parent = rb_parent(node)) && node == parent->rb_right)
+        node = parent;
+
+    return parent;
+}
@@ -21,6 +21,7 @@ int _rb_insert(rb_node node, rb_root root, bool (*cmp)(rb_node lnode, rb_node rn
 void _rb_erase(rb_node node, rb_root root);
 rb_node _rb_lookup(rb_node node, rb_root rt, bool (*cmp)(rb_node lnode, rb_node rnode));
 rb_node _rb_first(rb_root root);
+rb_node _rb_next(rb_node node);
 
 #define rb_init(root)                                                                    \
     ({                                                                                   \
@@ -3,6 +3,19 @@
 #include <kernel/sched.h>
 #include <kernel/printk.h>
 #include <common/list.h>
+#include <kernel/cpu.h>
+#include <driver/clock.h>
+
+#define TIMEOUT_RETRY_NS 10000 // 超时时进程还没睡下的重试间隔 (纳秒)
+
+// 等待体的对象缓存
+static SlabAlloc* waitdata_cache;
+
+// 初始化等待体的对象缓存 (main.c调用)
+void init_sem_cache()
+{
+    waitdata_cache = kmem_cache_create("waitdata", sizeof(WaitData), 8, NULL, NULL);
+}
 
 // 初始化信号量sem, 初始值为val
 void init_sem(Semaphore* sem, int val)
@@ -14,7 +27,12 @@ void init_sem(Semaphore* sem, int val)
 
 void _lock_sem(Semaphore* sem) { acquire_spinlock(&sem->lock); }
 
-void _unlock_sem(Semaphore* sem) { release_spinlock(&sem->lock); }
+// 释放锁后处理_post_sem唤醒引起的本CPU抢占
+void _unlock_sem(Semaphore* sem)
+{
+    release_spinlock(&sem->lock);
+    cond_resched();
+}
 
 // 尝试获取信号量sem (需要持有锁)
 // 获取成功返回true, 失败返回false
@@ -54,20 +72,17 @@ int post_all_sem(Semaphore* sem)
     return ret;
 }
 
-// 等待信号量sem (需要持有锁)
+// 等待信号量sem (需要持有锁, 返回时仍持有锁)
 // 如果是被唤醒的, 返回true
 // 如果是自己醒来的, 返回false
 bool _wait_sem(Semaphore* sem)
 {
     sem->val--;        // 信号量值减1
     if (sem->val >= 0) // 成功获取信号量 返回
-    {
-        release_spinlock(&sem->lock);
         return true;
-    }
 
     // 初始化等待体
-    WaitData* wait = kalloc(sizeof(WaitData));
+    WaitData* wait = kmem_cache_alloc(waitdata_cache);
     wait->proc = thisproc(); // 获取当前进程
     wait->up = false;        // 未被唤醒
 
@@ -90,7 +105,93 @@ bool _wait_sem(Semaphore* sem)
 
     // 返回唤醒状态
     bool ret = wait->up;
-    kfree(wait);
+    kmem_cache_free(waitdata_cache, wait);
+    return ret;
+}
+
+// 带超时的等待: 超时定时器及其对应的等待体
+typedef struct {
+    struct hrtimer timer;
+    Semaphore* sem;
+    WaitData* wait;
+} SemTimeout;
+
+// 等待超时, 唤醒仍在等待的进程 (由其自行从休眠链表中移除)
+// 在中断中执行: 自旋锁在等待和持有期间关闭中断, 本CPU上没有被打断的持锁者, 可以直接加锁
+// 进程已加入休眠链表但还没睡下时稍后重试, 否则唤醒会丢失
+static void __sem_timeout(struct hrtimer* t)
+{
+    auto st = (SemTimeout*)t->data;
+    auto p = st->wait->proc;
+
+    acquire_spinlock(&st->sem->lock); //*
+
+    // 已被post_sem唤醒
+    if (st->wait->up) {
+        release_spinlock(&st->sem->lock); //*
+        return;
+    }
+
+    acquire_spinlock(&p->lock); //**
+    bool asleep = (p->state == SLEEPING);
+    release_spinlock(&p->lock); //**
+
+    if (asleep)
+        activate_proc(p);
+
+    release_spinlock(&st->sem->lock); //*
+
+    if (!asleep)
+        hrtimer_start(t, get_timestamp() + ns_to_ticks(TIMEOUT_RETRY_NS));
+}
+
+// 最多等待ns纳秒的_wait_sem (需要持有锁, 返回时仍持有锁)
+// 获取到信号量返回true; 超时或被其他原因唤醒返回false
+// 超时定时器允许按进程的timer_slack延后, 以便与其他定时器合并
+bool _wait_sem_timeout(Semaphore* sem, u64 ns)
+{
+    if (_get_sem(sem))
+        return true;
+    if (ns == 0)
+        return false;
+
+    sem->val--;
+
+    // 初始化等待体, 添加到信号量的休眠链表
+    WaitData* wait = kmem_cache_alloc(waitdata_cache);
+    wait->proc = thisproc();
+    wait->up = false;
+    _insert_into_list(&sem->sleeplist, &wait->slnode);
+
+    // 启动超时定时器
+    SemTimeout st;
+    st.sem = sem;
+    st.wait = wait;
+    st.timer._armed = false;
+    st.timer.handler = __sem_timeout;
+    st.timer.data = (u64)&st;
+    hrtimer_start_range(&st.timer, get_timestamp() + ns_to_ticks(ns),
+        ns_to_ticks(wait->proc->schinfo.timer_slack));
+
+    release_spinlock(&sem->lock); // 释放信号量锁
+    acquire_sched();              // 准备调度
+    sched(SLEEPING);              // 设置当前进程为休眠 并启用调度
+    release_sched();              // 结束调度
+
+    // 等待可能在其他CPU上执行的超时处理函数结束, 之后才能释放栈上的定时器
+    // 处理函数会获取信号量锁, 需在加锁之前等待
+    hrtimer_cancel(&st.timer);
+    acquire_spinlock(&sem->lock); // 重新获取信号量锁
+
+    // 超时或被其他原因唤醒, 撤销等待
+    if (wait->up == false) {
+        sem->val++;
+        ASSERT(sem->val <= 0);
+        _detach_from_list(&wait->slnode);
+    }
+
+    bool ret = wait->up;
+    kmem_cache_free(waitdata_cache, wait);
     return ret;
 }
 
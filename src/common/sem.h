@@ -17,9 +17,11 @@ typedef struct {
     ListNode sleeplist; // 休眠链表
 } Semaphore;
 
+void init_sem_cache();
 void init_sem(Semaphore*, int val);
 void _post_sem(Semaphore*);
 bool _wait_sem(Semaphore*);
+bool _wait_sem_timeout(Semaphore*, u64 ns);
 bool _get_sem(Semaphore*);
 int _query_sem(Semaphore*);
 void _lock_sem(Semaphore*);
@@ -40,6 +42,13 @@ int post_all_sem(Semaphore*);
         _unlock_sem(sem);                                                                \
         __ret;                                                                           \
     })
+#define wait_sem_timeout(sem, ns)                                                        \
+    ({                                                                                   \
+        _lock_sem(sem);                                                                  \
+        bool __ret = _wait_sem_timeout(sem, ns);                                         \
+        _unlock_sem(sem);                                                                \
+        __ret;                                                                           \
+    })
 #define get_sem(sem)                                                                     \
     ({                                                                                   \
         _lock_sem(sem);                                                                  \
@@ -1,30 +1,100 @@
 #include <aarch64/intrinsic.h>
 #include <common/spinlock.h>
+#include <kernel/printk.h>
+#include <kernel/cpu.h>
 
 // 初始化自旋锁
 void init_spinlock(SpinLock* lock) {
-    lock->locked = 0;
+    lock->owner = 0;
+    lock->next = 0;
+#ifdef SPINLOCK_STAT
+    lock->acquired = lock->contended = lock->spins = 0;
+    lock->max_hold = lock->hold_start = 0;
+#endif
 }
 
+// 获取锁之前关闭中断, 记录本CPU持有(或等待)的锁的层数
+// 中断处理函数不会打断持锁或排队中的代码, 因此不会在同一CPU上自锁
+// 最外层记录原来的中断状态, 全部释放后再恢复
+static void __push_trap() {
+    bool trap = _arch_disable_trap();
+    auto c = thiscpu;
+    if (c->lock_depth++ == 0)
+        c->lock_trap = trap;
+}
+
+// 释放锁之后, 如果本CPU已不持有任何锁, 则恢复中断状态
+static void __pop_trap() {
+    auto c = thiscpu;
+    ASSERT(c->lock_depth > 0);
+    if (--c->lock_depth == 0 && c->lock_trap)
+        _arch_enable_trap();
+}
+
+#ifdef SPINLOCK_STAT
+// 获取锁之后记录统计 (此时持有锁, 无需原子操作)
+static void __stat_acquired(SpinLock* lock, u64 spins) {
+    lock->acquired++;
+    if (spins > 0) {
+        lock->contended++;
+        lock->spins += spins;
+    }
+    lock->hold_start = get_timestamp();
+}
+#endif
+
 // 尝试获取自旋锁
 bool try_acquire_spinlock(SpinLock* lock) {
-    // 如果锁未被占用, 则尝试获取锁
-    if (!lock->locked && !__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE)) {
-        return true;
-    } 
-    // 否则, 返回获取失败
-    else {
+    // 只有锁空闲 (没有持有者和排队者) 时才取号, 不会排在别人后面
+    __push_trap();
+    u32 ticket = lock->next;
+    if (lock->owner != ticket
+        || !__atomic_compare_exchange_n(&lock->next, &ticket, ticket + 1, false,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        __pop_trap();
         return false;
     }
+
+#ifdef SPINLOCK_STAT
+    __stat_acquired(lock, 0);
+#endif
+    return true;
 }
 
-// 循环获取自旋锁
+// 循环获取自旋锁: 取号后等待叫号
 void acquire_spinlock(SpinLock* lock) {
-    while (!try_acquire_spinlock(lock))
+    __push_trap();
+    u32 ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    u64 spins = 0;
+
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
         arch_yield();
+        spins++;
+    }
+
+#ifdef SPINLOCK_STAT
+    __stat_acquired(lock, spins);
+#endif
 }
 
-// 释放自旋锁
+// 释放自旋锁: 叫下一个号
 void release_spinlock(SpinLock* lock) {
-    __atomic_clear(&lock->locked, __ATOMIC_RELEASE);
+#ifdef SPINLOCK_STAT
+    u64 hold = get_timestamp() - lock->hold_start;
+    if (hold > lock->max_hold)
+        lock->max_hold = hold;
+#endif
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+    __pop_trap();
+}
+
+// 打印自旋锁的竞争统计 (未开启SPINLOCK_STAT时不做任何事)
+void spinlock_stat(const char* name, SpinLock* lock) {
+#ifdef SPINLOCK_STAT
+    printk("spinlock %s: acquired=%llu contended=%llu spins=%llu max_hold=%llu cycles\n", name,
+        lock->acquired, lock->contended, lock->spins, lock->max_hold);
+#else
+    (void)name;
+    (void)lock;
+#endif
 }
@@ -3,11 +3,26 @@
 #include <common/defines.h>
 #include <aarch64/intrinsic.h>
 
+// 开启后记录每个锁的竞争统计 (获取次数/自旋次数/最长持有时间)
+// #define SPINLOCK_STAT
+
+// 排队自旋锁 (ticket lock): 按取号顺序获得锁, 保证公平
+// 全零即为未加锁状态, 静态变量无需初始化
+// 从取号等待到释放期间关闭本CPU的中断, 必须在获取锁的CPU上释放
 typedef struct {
-    volatile bool locked;
+    volatile u32 owner; // 当前持有者的票号
+    volatile u32 next;  // 下一个发放的票号 (next==owner 表示空闲)
+#ifdef SPINLOCK_STAT
+    u64 acquired;   // 获取次数
+    u64 contended;  // 需要等待的获取次数
+    u64 spins;      // 累计自旋次数
+    u64 max_hold;   // 最长持有时间 (时钟周期)
+    u64 hold_start; // 本次获取的时间戳
+#endif
 } SpinLock;
 
 void init_spinlock(SpinLock*);         // 初始化自旋锁
 bool try_acquire_spinlock(SpinLock*);  // 尝试获取自旋锁
 void acquire_spinlock(SpinLock*);      // 获取自旋锁
 void release_spinlock(SpinLock*);      // 释放自旋锁
+void spinlock_stat(const char* name, SpinLock*); // 打印自旋锁的竞争统计
@@ -22,15 +22,22 @@ void init_clock()
 void reset_clock(u64 interval_ms)
 {
     // 将时间ms转换为CPU时钟周期数clk
-    u64 interval_clk = interval_ms * get_clock_frequency() / 1000;
+    reset_clock_tick(interval_ms * get_clock_frequency() / 1000);
+}
 
-    // 确保周期数clk不超过最大限度
-    ASSERT(interval_clk <= 0x7fffffff);
+// 重置定时器 等待时间 (时钟周期)
+void reset_clock_tick(u64 interval_tick)
+{
+    // 确保周期数不超过最大限度
+    ASSERT(interval_tick <= MAX_CLOCK_TICK);
 
     // 设置定时器 等待的时钟周期数
-    set_cntv_tval_el0(interval_clk);
+    set_cntv_tval_el0(interval_tick);
 }
 
+// 设置定时器 在时间戳到达tick时触发 (CNTV_CVAL为64位绝对值, 没有量程限制)
+void reset_clock_at(u64 tick) { set_cntv_cval_el0(tick); }
+
 // 配置定时器中断处理函数 (TIMER_IRQ)
 // cpu.c->init_clock_handler 跳转到这里
 void set_clock_handler(ClockHandler handler)
@@ -50,3 +57,17 @@ void invoke_clock_handler()
 
 // 获取当前时间戳 (毫秒)
 u64 get_timestamp_ms() { return get_timestamp() * 1000 / get_clock_frequency(); }
+
+// 纳秒 -> 时钟周期 (向上取整, 保证定时不会提前)
+// 使用128位中间值, 避免长时间间隔相乘溢出
+u64 ns_to_ticks(u64 ns)
+{
+    return (u64)(((unsigned __int128)ns * get_clock_frequency() + NSEC_PER_SEC - 1)
+        / NSEC_PER_SEC);
+}
+
+// 时钟周期 -> 纳秒 (向下取整)
+u64 ticks_to_ns(u64 ticks)
+{
+    return (u64)((unsigned __int128)ticks * NSEC_PER_SEC / get_clock_frequency());
+}
@@ -2,10 +2,19 @@
 
 #include <common/defines.h>
 
+// 定时器单次等待的最大时钟周期数 (TVAL为32位有符号数)
+#define MAX_CLOCK_TICK 0x7fffffff
+
 typedef void (*ClockHandler)(void);
 
+#define NSEC_PER_SEC 1000000000ull
+
 u64 get_timestamp_ms();
+u64 ns_to_ticks(u64 ns);
+u64 ticks_to_ns(u64 ticks);
 void init_clock();
 void reset_clock(u64 interval_ms);
+void reset_clock_tick(u64 interval_tick);
+void reset_clock_at(u64 tick);
 void set_clock_handler(ClockHandler handler);
 void invoke_clock_handler();
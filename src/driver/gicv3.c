@@ -2,7 +2,9 @@
 #include <common/defines.h>
 #include <driver/base.h>
 #include <driver/interrupt.h>
+#include <driver/ipi.h>
 #include <kernel/printk.h>
+#include <aarch64/intrinsic.h>
 
 #define GICD_CTLR (0x0)
 #define GICD_TYPER (0x4)
@@ -68,6 +70,10 @@ static inline void w_icc_eoir1_el1(u32 x) {
     asm volatile("msr S3_0_C12_C12_1, %0" : : "r"(x));
 }
 
+static inline void w_icc_sgi1r_el1(u64 x) {
+    asm volatile("msr S3_0_C12_C11_5, %0" : : "r"(x));
+}
+
 static inline u32 icc_sre_el1() {
     u32 x;
     asm volatile("mrs %0, S3_0_C12_C12_5" : "=r"(x));
@@ -221,6 +227,8 @@ void gicv3_init_percpu() {
     gic_redist_init(cpu);
 
     gic_setup_ppi(cpuid(), TIMER_IRQ, 0);
+    for (u32 i = 0; i < NUM_IPI_TYPES; i++)
+        gic_setup_ppi(cpuid(), IPI_IRQ + i, 0);
 
     gic_enable();
 }
@@ -252,4 +260,17 @@ static bool is_sgi_ppi(u32 id) {
         return true;
     else
         return false;
-}
\ No newline at end of file
+}
+
+// 向cpu_mask中的CPU发送SGI (intid < 16)
+// 所有CPU的Aff1~Aff3均为0, TargetList的第i位即对应Aff0=i的CPU
+void gic_send_sgi(u64 cpu_mask, u32 intid) {
+    if (!is_sgi_ppi(intid) || intid >= 16) {
+        PANIC();
+    }
+
+    // 确保之前的内存写入 对目标CPU可见
+    arch_fence();
+    w_icc_sgi1r_el1(((u64)intid << 24) | (cpu_mask & 0xffff));
+    arch_isb();
+}
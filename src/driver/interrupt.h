@@ -3,6 +3,7 @@
 #define NUM_IRQ_TYPES 64
 
 typedef enum {
+    IPI_IRQ = 1, // 处理器间中断的起始SGI编号, 每种IPI占用一个SGI (见ipi.h)
     TIMER_IRQ = 27,
     UART_IRQ = 33,
     VIRTIO_BLK_IRQ = 48
@@ -0,0 +1,159 @@
+#include <aarch64/intrinsic.h>
+#include <common/list.h>
+#include <driver/gicv3.h>
+#include <driver/interrupt.h>
+#include <driver/ipi.h>
+#include <kernel/cpu.h>
+#include <kernel/printk.h>
+
+static IpiHandler ipi_handler[NUM_IPI_TYPES];
+
+// 一次跨CPU函数调用请求 (位于调用者栈上)
+typedef struct IpiCall {
+    QueueNode node;     // 串在目标CPU请求队列中的结点
+    void (*func)(u64);  // 要执行的函数
+    u64 arg;            // 函数参数
+    volatile bool done; // 请求是否已结束 (执行完毕, 或目标CPU下线时被丢弃)
+    bool ran;           // 是否真正执行了 (done之前写入)
+} IpiCall;
+
+// 每个CPU待执行的调用请求 (无锁栈)
+static QueueNode* call_queue[NCPU];
+
+// CPU下线后其请求队列的头, 之后不再接受请求
+#define CALL_QUEUE_CLOSED ((QueueNode*)1)
+
+// 将请求压入第cpu个CPU的请求队列, 队列已关闭 (CPU已下线) 时返回false
+static bool __push_call(int cpu, IpiCall* call)
+{
+    auto head = __atomic_load_n(&call_queue[cpu], __ATOMIC_RELAXED);
+    do {
+        if (head == CALL_QUEUE_CLOSED)
+            return false;
+        call->node.next = head;
+    } while (!__atomic_compare_exchange_n(
+        &call_queue[cpu], &head, &call->node, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+// 执行本CPU上所有待执行的调用请求 (需关闭中断)
+static void __run_calls()
+{
+    auto node = fetch_all_from_queue(&call_queue[cpuid()]);
+
+    while (node != NULL) {
+        auto call = container_of(node, IpiCall, node);
+
+        // 置done后请求所在的栈可能立即失效, 先取出后继
+        node = node->next;
+
+        call->func(call->arg);
+        call->ran = true;
+        __atomic_store_n(&call->done, true, __ATOMIC_RELEASE);
+    }
+}
+
+// 关闭本CPU的请求队列并丢弃尚未执行的请求 (set_cpu_off调用, 需关闭中断)
+// 请求位于调用者栈上, 不能留在不再处理的队列中; 丢弃后调用者不再等待, 也不会再有请求入队
+// 不执行被丢弃的请求: 下线可能发生在panic中, 此时不宜运行任意函数
+void ipi_cpu_off()
+{
+    auto node = __atomic_exchange_n(&call_queue[cpuid()], CALL_QUEUE_CLOSED, __ATOMIC_ACQ_REL);
+
+    while (node != NULL) {
+        auto call = container_of(node, IpiCall, node);
+        node = node->next;
+        __atomic_store_n(&call->done, true, __ATOMIC_RELEASE);
+    }
+}
+
+static void ipi_call_handler() { __run_calls(); }
+
+// interrupt.c->interrupt_global_handler 跳转到这里
+static void ipi_dispatch(u32 intid)
+{
+    auto handler = ipi_handler[intid - IPI_IRQ];
+    if (handler)
+        handler();
+}
+
+// 注册所有IPI的中断处理函数 (需在init_interrupt之后调用)
+void init_ipi()
+{
+    for (int i = 0; i < NUM_IPI_TYPES; i++) {
+        ipi_handler[i] = NULL;
+        set_interrupt_handler(IPI_IRQ + i, ipi_dispatch);
+    }
+
+    for (int i = 0; i < NCPU; i++)
+        call_queue[i] = NULL;
+
+    set_ipi_handler(IPI_CALL, ipi_call_handler);
+}
+
+// 设置某种IPI的处理函数
+void set_ipi_handler(IpiType type, IpiHandler handler) { ipi_handler[type] = handler; }
+
+// 向cpu_mask中的所有CPU发送IPI
+void send_ipi(u64 cpu_mask, IpiType type)
+{
+    if (cpu_mask != 0)
+        gic_send_sgi(cpu_mask, IPI_IRQ + type);
+}
+
+// 在cpu_mask中的所有在线CPU上执行func(arg), 全部结束后返回实际执行了的CPU集合
+// 未启动或已下线的CPU被跳过; 等待期间下线的CPU丢弃请求 (见ipi_cpu_off), 不计入返回值
+// 等待期间会处理发给本CPU的调用请求, 两个CPU互相调用时不会死锁
+// 调用者不能持有自旋锁: 目标CPU可能正关中断等待这把锁, 无法响应请求
+u64 ipi_call(u64 cpu_mask, void (*func)(u64), u64 arg)
+{
+    IpiCall calls[NCPU];
+    u64 ran = 0;
+
+    ASSERT(thiscpu->lock_depth == 0);
+
+    // 关闭中断, 防止等待期间被调度到其他CPU
+    bool trap = _arch_disable_trap(); //*
+    u64 self = BIT(cpuid());
+
+    // 未启动的CPU的队列没有关闭, 但不会有人处理, 同样跳过
+    for (int i = 0; i < NCPU; i++)
+        if (!cpus[i].online)
+            cpu_mask &= ~BIT(i);
+
+    for (int i = 0; i < NCPU; i++) {
+        if (!(cpu_mask & BIT(i)) || BIT(i) == self)
+            continue;
+        calls[i].func = func;
+        calls[i].arg = arg;
+        calls[i].done = false;
+        calls[i].ran = false;
+        if (!__push_call(i, &calls[i]))
+            cpu_mask &= ~BIT(i);
+    }
+
+    send_ipi(cpu_mask & ~self, IPI_CALL);
+
+    if (cpu_mask & self) {
+        func(arg);
+        ran |= self;
+    }
+
+    for (int i = 0; i < NCPU; i++) {
+        if (!(cpu_mask & BIT(i)) || BIT(i) == self)
+            continue;
+        // 入队成功的请求一定会结束: 由目标CPU执行, 或在其下线时丢弃
+        while (!__atomic_load_n(&calls[i].done, __ATOMIC_ACQUIRE)) {
+            __run_calls();
+            arch_yield();
+        }
+        if (calls[i].ran)
+            ran |= BIT(i);
+    }
+
+    if (trap)
+        _arch_enable_trap(); //*
+
+    return ran;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <common/defines.h>
+
+// 处理器间中断类型, 类型i 使用 SGI (IPI_IRQ + i)
+typedef enum {
+    IPI_RESCHED, // 唤醒在WFI中睡眠的空闲CPU
+    IPI_CALL,    // 在目标CPU上执行函数 (ipi_call)
+    NUM_IPI_TYPES
+} IpiType;
+
+typedef void (*IpiHandler)();
+
+void init_ipi();
+void set_ipi_handler(IpiType type, IpiHandler handler);
+void send_ipi(u64 cpu_mask, IpiType type);
+u64 ipi_call(u64 cpu_mask, void (*func)(u64), u64 arg);
+void ipi_cpu_off();
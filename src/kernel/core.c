@@ -1,5 +1,7 @@
 #include <aarch64/intrinsic.h>
 #include <kernel/cpu.h>
+#include <kernel/mem.h>
+#include <driver/ipi.h>
 #include <kernel/printk.h>
 #include <kernel/sched.h>
 #include <test/test.h>
@@ -16,6 +18,10 @@ volatile bool panic_flag;
 NO_RETURN void idle_entry()
 {
     set_cpu_on();
+    init_sched_percpu();
+
+    // idle进程在中断开启的状态下运行, 以响应定时器和IPI
+    _arch_enable_trap();
 
     while (1) {
         acquire_sched();
@@ -25,7 +31,11 @@ NO_RETURN void idle_entry()
         if (panic_flag)
             break;
 
-        // arch_with_trap { arch_wfi(); }
+        // 没有可运行的进程时, 先预先清零页, 无事可做再进入WFI睡眠
+        if (kalloc_zero_fill())
+            continue;
+
+        idle_wait();
     }
 
     set_cpu_off();
@@ -57,6 +67,9 @@ NO_INLINE NO_RETURN void _panic(const char* file, int line)
     // 设置panic标志, 通知其他CPU停止
     panic_flag = true;
 
+    // 唤醒在WFI中睡眠的CPU, 使其看到panic标志
+    send_ipi((BIT(NCPU) - 1) & ~BIT(cpuid()), IPI_RESCHED);
+
     // 关闭当前CPU
     set_cpu_off();
 
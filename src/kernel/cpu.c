@@ -5,88 +5,253 @@
 #include <aarch64/mmu.h>
 #include <driver/timer.h>
 #include <driver/clock.h>
+#include <driver/ipi.h>
 
 struct cpu cpus[NCPU];
 
-// 定时器比较函数
-// true:  lnode < rnode
-// false: lnode >= rnode
-static bool __timer_cmp(rb_node lnode, rb_node rnode)
+// 时间轮的时间单位 = 2^wheel_shift 个时钟周期 (约30微秒)
+static u64 wheel_shift;
+
+// 层lvl的粒度位移
+#define __lvl_shift(lvl) ((lvl) * WHEEL_CLK_SHIFT)
+
+// 把定时器挂载到时间轮的槽位 (需关闭中断)
+static void __wheel_add(struct timer_wheel* w, struct timer* timer)
+{
+    // 到期时间 (时间单位, 向上取整), 已过期的放入当前槽位
+    u64 expires = (timer->_key + BIT(wheel_shift) - 1) >> wheel_shift;
+    if (expires < w->clk)
+        expires = w->clk;
+
+    // 在允许的延后范围内, 对齐到尽量大的2的幂边界
+    // 相近的定时器会落在同一时刻, 由同一次中断触发
+    u64 latest = (timer->_key + timer->slack_tick) >> wheel_shift;
+    if (latest > expires)
+        expires = latest & ~(BIT(63 - __builtin_clzll(latest ^ expires)) - 1);
+
+    // 选择能容纳该到期时间的最低层, 超出最高层量程的截断到最远槽位 (到期时重新挂载)
+    for (int lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+        int sh = __lvl_shift(lvl);
+        u64 base = w->clk >> sh;
+        u64 e = (expires + BIT(sh) - 1) >> sh;
+
+        if (e - base >= WHEEL_SIZE) {
+            if (lvl < WHEEL_LEVELS - 1)
+                continue;
+            e = base + WHEEL_SIZE - 1;
+        }
+
+        int idx = e & (WHEEL_SIZE - 1);
+        _insert_into_list(&w->slot[lvl][idx], &timer->_node);
+        w->pending[lvl] |= BIT(idx);
+        timer->_slot = lvl * WHEEL_SIZE + idx;
+        timer->_armed = true;
+        return;
+    }
+}
+
+// 从时间轮卸载定时器 (需关闭中断)
+static void __wheel_del(struct timer_wheel* w, struct timer* timer)
 {
-    i64 d = container_of(lnode, struct timer, _node)->_key
-        - container_of(rnode, struct timer, _node)->_key;
+    int lvl = timer->_slot / WHEEL_SIZE;
+    int idx = timer->_slot % WHEEL_SIZE;
 
-    // (lkey < rkey)
-    if (d < 0)
-        return true;
+    _detach_from_list(&timer->_node);
+    if (_empty_list(&w->slot[lvl][idx]))
+        w->pending[lvl] &= ~BIT(idx);
+    timer->_armed = false;
+}
 
-    // (lkey == rkey)
-    // 键值相等时, 比较地址
-    if (d == 0)
-        return lnode < rnode;
+// 时间轮中最早的非空槽位的处理时刻 (时间单位), 没有定时器时返回-1
+// 每层只需把位图从当前位置循环移位后找最低位, 不需要遍历槽位
+static u64 __wheel_next(struct timer_wheel* w)
+{
+    u64 next = (u64)-1;
+
+    for (int lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+        u64 bitmap = w->pending[lvl];
+        if (!bitmap)
+            continue;
+
+        int sh = __lvl_shift(lvl);
+        u64 start = (w->clk + BIT(sh) - 1) >> sh;
+        int off = start & (WHEEL_SIZE - 1);
+        if (off)
+            bitmap = (bitmap >> off) | (bitmap << (WHEEL_SIZE - off));
+
+        u64 t = (start + (u64)__builtin_ctzll(bitmap)) << sh;
+        if (t < next)
+            next = t;
+    }
 
-    // (lkey > rkey)
-    return false;
+    return next;
 }
 
-// 通过定时红黑树 更新定时器值
-static void __timer_set_clock()
+// 把时间轮推进到now (时间单位), 但不越过尚未处理的槽位
+// 保持clk接近当前时间, 新定时器才能放入足够精细的层
+static void __wheel_forward(struct timer_wheel* w, u64 now)
 {
-    // 获取红黑树中的最左侧结点 (最小时间戳)
-    auto node = _rb_first(&cpus[cpuid()].timer);
+    u64 next = __wheel_next(w);
+    if (now > next)
+        now = next;
+    if (now > w->clk)
+        w->clk = now;
+}
+
+// 取出在时刻clk处理的所有槽位 (各层中粒度对齐clk的槽位), 并推进clk
+static void __wheel_collect(struct timer_wheel* w, ListNode* expired)
+{
+    for (int lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+        int sh = __lvl_shift(lvl);
+        if (w->clk & (BIT(sh) - 1))
+            break;
 
-    // 如果树为空, 则设置定时器间隔
-    if (!node) {
-        reset_clock(10);
+        int idx = (w->clk >> sh) & (WHEEL_SIZE - 1);
+        if (!(w->pending[lvl] & BIT(idx)))
+            continue;
+
+        auto head = &w->slot[lvl][idx];
+        _merge_list(expired, head);
+        _detach_from_list(head);
+        w->pending[lvl] &= ~BIT(idx);
+    }
+
+    w->clk++;
+}
+
+// 高精度定时器比较函数: 按到期时刻排序, 相等时比较地址
+static bool __hrtimer_cmp(rb_node lnode, rb_node rnode)
+{
+    auto l = container_of(lnode, struct hrtimer, _node);
+    auto r = container_of(rnode, struct hrtimer, _node);
+    if (l->_hard != r->_hard)
+        return l->_hard < r->_hard;
+    return lnode < rnode;
+}
+
+// 通过时间轮和高精度定时器 更新定时器值 (需关闭中断)
+static void __timer_set_clock()
+{
+    // 获取最早的非空槽位
+    auto next = __wheel_next(&thiscpu->timer);
+    u64 t1 = next == (u64)-1 ? (u64)-1 : next << wheel_shift;
+
+    // 与最早的高精度定时器比较
+    auto root = &thiscpu->hrtimer;
+    acquire_spinlock(&root->lock); //**
+    auto node = _rb_first(root);
+    if (node && container_of(node, struct hrtimer, _node)->_hard < t1)
+        t1 = container_of(node, struct hrtimer, _node)->_hard;
+    release_spinlock(&root->lock); //**
+
+    // 如果没有定时器, 则屏蔽定时器中断 (无周期时钟)
+    if (t1 == (u64)-1) {
+        disable_timer();
         return;
     }
 
-    // 获取最接近的 定时中断时间戳
-    auto t1 = container_of(node, struct timer, _node)->_key;
+    // 直接设置比较值CNTV_CVAL, 已过期时立即触发
+    enable_timer();
+    reset_clock_at(t1);
+}
+
+// 执行本CPU上所有到期的高精度定时器
+// 按最晚到期时刻设置中断, 触发时顺带执行已过最早到期时刻的定时器
+static void __hrtimer_run()
+{
+    auto root = &thiscpu->hrtimer;
+
+    for (;;) {
+        acquire_spinlock(&root->lock); //**
+
+        // 获取最早到期的定时器, 如果还没到触发时间, 则退出
+        auto node = _rb_first(root);
+        auto timer = node ? container_of(node, struct hrtimer, _node) : NULL;
+        if (timer == NULL || get_timestamp() < timer->expires) {
+            release_spinlock(&root->lock); //**
+            break;
+        }
+
+        // 卸载并标记为正在执行, 供hrtimer_cancel等待
+        _rb_erase(node, root);
+        timer->_armed = false;
+        thiscpu->hrtimer_running = timer;
 
-    // 获取当前时间戳
-    auto t0 = get_timestamp_ms();
+        release_spinlock(&root->lock); //**
 
-    // 更新定时器
-    if (t1 <= t0)
-        reset_clock(0);
-    else
-        reset_clock(t1 - t0);
+        timer->triggered = true;
+        thiscpu->timers_fired++;
+        timer->handler(timer);
+
+        arch_fence();
+        thiscpu->hrtimer_running = NULL;
+    }
 }
 
 // clock.c->invoke_clock_handler 跳转到这里
 static void timer_clock_handler()
 {
-    reset_clock(10);
+    auto w = &thiscpu->timer;
 
-    for (;;) {
-        // 获取红黑树中的最左侧结点
-        auto node = _rb_first(&cpus[cpuid()].timer);
+    thiscpu->timer_irqs++;
+    __hrtimer_run();
 
-        // 如果红黑树为空, 则退出
-        if (node == NULL)
+    for (;;) {
+        // 获取最早的非空槽位, 如果还没到处理时间, 则退出
+        auto next = __wheel_next(w);
+        if (next > get_timestamp() >> wheel_shift)
             break;
 
-        // 获取当前最小的定时器时间戳
-        auto timer = container_of(node, struct timer, _node);
+        // 取出该时刻到期的定时器 (先全部取出, 处理函数重新挂载时不会再次落入)
+        ListNode expired;
+        init_list_node(&expired);
+        w->clk = next;
+        __wheel_collect(w, &expired);
 
-        // 如果还没到触发时间, 则退出
-        if (get_timestamp_ms() < timer->_key)
-            break;
+        while (!_empty_list(&expired)) {
+            auto node = expired.next;
+            _detach_from_list(node);
 
-        // 从CPU定时红黑树卸载timer
-        cancel_cpu_timer(timer);
+            auto timer = container_of(node, struct timer, _node);
+            timer->_armed = false;
 
-        // 设置触发标志
-        timer->triggered = true;
+            // 被截断的远期定时器还没到触发时间, 重新挂载
+            if (get_timestamp() < timer->_key) {
+                __wheel_add(w, timer);
+                continue;
+            }
 
-        // 调用定时器处理函数
-        timer->handler(timer);
+            // 设置触发标志
+            timer->triggered = true;
+            thiscpu->timers_fired++;
+
+            // 调用定时器处理函数 (不会切换进程, w和expired在整个循环中都属于本CPU)
+            timer->handler(timer);
+        }
     }
+
+    // 按最近的定时器重新设置, 没有定时器时屏蔽中断
+    __wheel_forward(w, get_timestamp() >> wheel_shift);
+    __timer_set_clock();
 }
 
 // 初始化定时器中断处理函数 (main.c调用)
-void init_clock_handler() { set_clock_handler(&timer_clock_handler); }
+void init_clock_handler()
+{
+    // 时间单位取不超过 1/31250 秒 的最大2的幂个时钟周期
+    u64 unit = get_clock_frequency() / 31250;
+    wheel_shift = unit ? 63 - __builtin_clzll(unit) : 0;
+
+    for (int i = 0; i < NCPU; i++) {
+        for (int lvl = 0; lvl < WHEEL_LEVELS; lvl++)
+            for (int k = 0; k < WHEEL_SIZE; k++)
+                init_list_node(&cpus[i].timer.slot[lvl][k]);
+        rb_init(&cpus[i].hrtimer);
+        cpus[i].hrtimer_running = NULL;
+    }
+
+    set_clock_handler(&timer_clock_handler);
+}
 
 static struct timer hello_timer[4];
 
@@ -97,43 +262,131 @@ static void hello(struct timer* t)
     set_cpu_timer(&hello_timer[cpuid()]);  // 重新挂载hello_timer
 }
 
-// 把timer挂载到CPU的定时红黑树上
+// 把timer挂载到CPU的时间轮上
 void set_cpu_timer(struct timer* timer)
 {
-    _arch_disable_trap(); //* 关闭中断
+    bool trap = _arch_disable_trap(); //* 关闭中断
+
+    auto w = &thiscpu->timer;
 
     // 如果已存在, 则移除原来的定时器
-    if (_rb_lookup(&timer->_node, &cpus[cpuid()].timer, __timer_cmp))
-        _rb_erase(&timer->_node, &cpus[cpuid()].timer);
+    if (timer->_armed)
+        __wheel_del(w, timer);
 
     // 清除触发标志
     timer->triggered = false;
 
-    // 设置键值为 当前时间+间隔时间
-    timer->_key = get_timestamp_ms() + timer->elapse;
+    // 设置键值为 当前时间+间隔时间 (时钟周期)
+    u64 now = get_timestamp();
+    u64 interval = timer->elapse_tick;
+    if (interval == 0)
+        interval = (u64)timer->elapse * get_clock_frequency() / 1000;
+    timer->_key = now + interval;
 
-    // 将结点插入 定时红黑树
-    ASSERT(0 == _rb_insert(&timer->_node, &cpus[cpuid()].timer, __timer_cmp));
+    // 将定时器挂载到 时间轮
+    __wheel_forward(w, now >> wheel_shift);
+    __wheel_add(w, timer);
 
-    // 通过定时红黑树 更新定时器值
+    // 通过时间轮 更新定时器值
     __timer_set_clock();
 
-    _arch_enable_trap(); //* 开启中断
+    if (trap)
+        _arch_enable_trap(); //* 恢复中断
 }
 
-// 从定时红黑树中删除结点timer
+// 从时间轮中删除定时器timer
 void cancel_cpu_timer(struct timer* timer)
 {
-    _arch_disable_trap(); //* 关闭中断
+    bool trap = _arch_disable_trap(); //* 关闭中断
+
+    // 如果存在, 则从时间轮中删除定时器timer
+    if (timer->_armed)
+        __wheel_del(&thiscpu->timer, timer);
+
+    // 通过时间轮 更新定时器值
+    __timer_set_clock();
+
+    if (trap)
+        _arch_enable_trap(); //* 恢复中断
+}
+
+// 在当前CPU上启动高精度定时器, 时间戳到达expires (时钟周期) 时触发
+void hrtimer_start(struct hrtimer* timer, u64 expires) { hrtimer_start_range(timer, expires, 0); }
+
+// 在当前CPU上启动高精度定时器, 在 [expires, expires+slack] 内触发
+// 已启动的定时器先取消再重新启动
+void hrtimer_start_range(struct hrtimer* timer, u64 expires, u64 slack)
+{
+    if (timer->_armed)
+        hrtimer_cancel(timer);
 
-    // 如果存在, 则从定时红黑树中删除结点timer
-    if (_rb_lookup(&timer->_node, &cpus[cpuid()].timer, __timer_cmp))
-        _rb_erase(&timer->_node, &cpus[cpuid()].timer);
+    bool trap = _arch_disable_trap(); //*
+
+    auto root = &thiscpu->hrtimer;
+    acquire_spinlock(&root->lock); //**
+    timer->triggered = false;
+    timer->expires = expires;
+    timer->slack = slack;
+    timer->_hard = expires + slack;
+    timer->_cpu = cpuid();
+    timer->_armed = true;
+    ASSERT(0 == _rb_insert(&timer->_node, root, __hrtimer_cmp));
+    release_spinlock(&root->lock); //**
 
-    // 通过定时红黑树 更新定时器值
     __timer_set_clock();
 
-    _arch_enable_trap(); //* 开启中断
+    if (trap)
+        _arch_enable_trap(); //*
+}
+
+// 取消高精度定时器 (可在任意CPU上调用), 返回定时器是否尚未触发
+// 如果处理函数正在其他CPU上执行, 则等待其结束, 返回后可以安全释放定时器
+bool hrtimer_cancel(struct hrtimer* timer)
+{
+    for (;;) {
+        bool trap = _arch_disable_trap(); //*
+
+        auto c = &cpus[timer->_cpu];
+        acquire_spinlock(&c->hrtimer.lock); //**
+        bool armed = timer->_armed;
+        if (armed) {
+            _rb_erase(&timer->_node, &c->hrtimer);
+            timer->_armed = false;
+        }
+        bool running = c->hrtimer_running == timer;
+        release_spinlock(&c->hrtimer.lock); //**
+
+        if (trap)
+            _arch_enable_trap(); //*
+
+        // 不会重新挂载被取消的定时器, 多余的中断由处理函数重新设置
+        if (!running)
+            return armed;
+        arch_yield();
+    }
+}
+
+// 所有CPU的定时器中断总次数
+u64 timer_irq_count()
+{
+    u64 sum = 0;
+    for (int i = 0; i < NCPU; i++)
+        sum += cpus[i].timer_irqs;
+    return sum;
+}
+
+// 打印每个CPU的定时器中断统计
+void timer_stat()
+{
+    u64 secs = get_timestamp() / get_clock_frequency();
+    if (secs == 0)
+        secs = 1;
+
+    for (int i = 0; i < NCPU; i++) {
+        auto c = &cpus[i];
+        printk("timer: CPU %d: irqs=%llu (%llu/s) fired=%llu\n", i, c->timer_irqs,
+            c->timer_irqs / secs, c->timers_fired);
+    }
 }
 
 void set_cpu_on()
@@ -172,6 +425,9 @@ void set_cpu_off()
     // 关闭当前CPU中断
     _arch_disable_trap();
 
+    // 关闭跨CPU调用队列, 丢弃尚未执行的请求
+    ipi_cpu_off();
+
     // 停用当前CPU
     cpus[cpuid()].online = false;
 
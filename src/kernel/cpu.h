@@ -9,11 +9,41 @@ struct sched {
     Proc* proc;      // 当前CPU上运行的进程, 或者为空
     Proc* idle_proc; // 当前CPU专属idle进程
     Proc* before_proc;  // 记录跳转到idle之前的进程
+    struct rb_root_ rq; // 本CPU的分时调度队列: 按vruntime排序的红黑树 (需持有树锁)
+    u64 min_vruntime;   // 调度队列的最小虚拟运行时间 (单调递增)
+    ListNode rt_queue[RT_PRIO_MAX + 1]; // 实时调度队列: 每个优先级一条链表 (需持有树锁)
+    u64 rt_bitmap[2];                   // 非空实时队列的位图 (需持有树锁)
+    volatile bool idling; // 空闲且准备在WFI中睡眠, 需要SGI唤醒
+    volatile bool need_resched; // 有应当抢占当前进程的进程被唤醒, 在中断/异常返回前切换
+    int nr_running;       // 调度队列中的进程数 (需持有树锁)
+    int nr_allowed[NCPU]; // 调度队列中允许在各CPU上运行的进程数 (需持有树锁)
+    u64 load;             // 调度队列中分时进程的权重之和 (需持有树锁)
 };
 
+// 分层时间轮: 每层WHEEL_SIZE个槽, 第L层的粒度为 2^(L*WHEEL_CLK_SHIFT) 个时间单位
+// 定时器按到期时间距当前的远近放入对应层, 到期时间向上取整到该层粒度 (只会晚触发, 误差约1/8)
+#define WHEEL_LEVELS 8
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_CLK_SHIFT 3
+
+struct timer_wheel {
+    u64 clk;                                   // 下一个待处理的时间单位
+    u64 pending[WHEEL_LEVELS];                 // 每层非空槽位的位图
+    ListNode slot[WHEEL_LEVELS][WHEEL_SIZE];   // 每个槽位的定时器链表
+};
+
+struct hrtimer;
+
 struct cpu {
-    bool online;           // 是否启用
-    struct rb_root_ timer; // 计时器 (红黑树)
+    bool online;              // 是否启用
+    struct timer_wheel timer; // 计时器 (分层时间轮, 需关闭中断)
+    struct rb_root_ hrtimer;  // 高精度定时器 (按到期时刻排序的红黑树, 需持有树锁并关闭中断)
+    struct hrtimer* volatile hrtimer_running; // 正在执行处理函数的高精度定时器
+    int lock_depth;           // 本CPU持有(或等待)的自旋锁层数, 非0时中断关闭
+    bool lock_trap;           // 获取最外层锁之前的中断状态
+    u64 timer_irqs;           // 定时器中断次数
+    u64 timers_fired;         // 触发的定时器个数 (时间轮+高精度)
     struct sched sched;    // 每个CPU的调度信息
 };
 
@@ -23,17 +53,42 @@ extern struct cpu cpus[NCPU];
 // 定时器
 struct timer {
     bool triggered;                 // 是否已经被触发
-    int elapse;                     // 下次触发时间
-    u64 _key;                       // 红黑树比较中的key
-    struct rb_node_ _node;          // 红黑树结点
-    void (*handler)(struct timer*); // 处理函数
+    int elapse;                     // 触发间隔 (毫秒)
+    u64 elapse_tick;                // 触发间隔 (时钟周期), 非0时代替elapse, 用于亚毫秒定时
+    u64 slack_tick;                 // 允许延后的时钟周期数, 在此范围内对齐以与其他定时器合并触发
+    u64 _key;                       // 触发时刻 (时钟周期)
+    bool _armed;                    // 是否挂载在时间轮上
+    int _slot;                      // 所在的时间轮槽位 (层*WHEEL_SIZE+槽)
+    ListNode _node;                 // 时间轮槽位链表结点
+    void (*handler)(struct timer*); // 处理函数 (中断中执行, 不能调用sched)
     u64 data;                       // 定时触发次数
 };
 
+// 高精度定时器: 到期时刻为CNTVCT的绝对时钟周期数, 不经过时间轮取整
+// 可在任意CPU上取消, 适合短时睡眠等需要精确唤醒的场景
+struct hrtimer {
+    bool triggered;                   // 是否已经被触发
+    u64 expires;                      // 最早到期时刻 (时钟周期)
+    u64 slack;                        // 允许延后的时钟周期数
+    u64 _hard;                        // 最晚到期时刻 expires+slack, 红黑树按此排序
+    bool _armed;                      // 是否挂载在红黑树上 (需持有树锁)
+    int _cpu;                         // 挂载的CPU
+    struct rb_node_ _node;            // 红黑树结点
+    void (*handler)(struct hrtimer*); // 处理函数
+    u64 data;                         // 处理函数的参数
+};
+
 void init_clock_handler();
 
 void set_cpu_on();
 void set_cpu_off();
 
 void set_cpu_timer(struct timer* timer);
-void cancel_cpu_timer(struct timer* timer);
\ No newline at end of file
+void cancel_cpu_timer(struct timer* timer);
+
+void hrtimer_start(struct hrtimer* timer, u64 expires);
+void hrtimer_start_range(struct hrtimer* timer, u64 expires, u64 slack);
+bool hrtimer_cancel(struct hrtimer* timer);
+
+u64 timer_irq_count();
+void timer_stat();
\ No newline at end of file
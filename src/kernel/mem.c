@@ -1,5 +1,4 @@
 #include <aarch64/mmu.h>
-#include <common/rc.h>
 #include <common/spinlock.h>
 #include <driver/memlayout.h>
 #include <kernel/mem.h>
@@ -7,174 +6,1128 @@
 #include <common/defines.h>
 #include <common/string.h>
 #include <common/list.h>
+#include <kernel/cpu.h>
+#include <aarch64/intrinsic.h>
+
+// 启用Slab调试模式: 红区, 毒化, 重复释放检测, 记录调用者
+// #define SLAB_DEBUG
+
+// 启用分配剖析: 按调用点统计kalloc/kfree/kalloc_page/kfree_page
+// #define KALLOC_PROFILE
 
-RefCount kalloc_page_cnt;
 static SpinLock kalloc_page_lock;
 extern char end[];
 
-// 空闲页链表 (单向链表)
+// 页缓存中的空闲页 (单向链表)
 typedef struct FreePage {
     struct FreePage* next;
 } FreePage;
 
-static FreePage* free_page_head;
+// 物理页描述符 (覆盖 [EXTMEM, PHYSTOP) 的每一页)
+typedef struct PageInfo {
+    u8 order; // 块的阶数 (仅对空闲块和大对象的首页有效)
+    u8 flags; // 页标志
+#ifdef KALLOC_PROFILE
+    u64 caller; // 分配该页的调用点
+#endif
+} PageInfo;
+
+#define PG_FREE BIT(0)  // 该页是伙伴系统中空闲块的首页
+#define PG_LARGE BIT(1) // 该页是kalloc大对象的首页
+
+#define NPAGES ((u64)(PHYSTOP - EXTMEM) / PAGE_SIZE)   // 物理页总数
+#define PFN(p) (((u64)(p) - P2K(EXTMEM)) / PAGE_SIZE)    // 内核地址 -> 页号
+#define PFN2PAGE(pfn) ((void*)(P2K(EXTMEM) + (u64)(pfn) * PAGE_SIZE)) // 页号 -> 内核地址
+
+static PageInfo* page_info; // 物理页描述符数组 (放在内核末尾)
+
+// 高水位线: 页号不小于heap_pfn的页尚未交给伙伴系统, 其描述符也未初始化
+// 伙伴系统没有合适的空闲块时, 才从高水位线切出新块 (需持有kalloc_page_lock)
+static u64 heap_pfn;
+
+// 伙伴系统: 每一阶的空闲块链表 (需持有kalloc_page_lock)
+// 第k阶的空闲块由 2^k 个连续页组成, 且首页页号对齐到 2^k
+typedef struct FreeArea {
+    ListNode list; // 空闲块链表 (结点存放在空闲块首页)
+    usize cnt;     // 空闲块数量
+} FreeArea;
+
+static FreeArea free_area[MAX_ORDER + 1];
+
+#define PAGE_CACHE_MAX 64   // 每个CPU最多缓存的页数
+#define PAGE_CACHE_BATCH 32 // 与伙伴系统批量交换的页数
+#define ZERO_POOL_MAX 32    // 每个CPU最多预先清零的页数
+
+// 每个CPU的页缓存 (独占一条缓存行, 避免伪共享)
+typedef struct PageCache {
+    FreePage* head; // 缓存页链表
+    int cnt;        // 缓存页数量
+    isize page_cnt; // 本CPU的页分配计数 (分配-释放, 可能为负)
+    FreePage* zero_head; // 预清零页链表 (除链表指针外全为0)
+    int zero_cnt;        // 预清零页数量
+} __attribute__((aligned(64))) PageCache;
+
+static PageCache page_cache[NCPU];
+
+#ifdef KALLOC_PROFILE
+#define PROF_SITES 256      // 每个CPU的调用点表容量 (开放寻址)
+#define PROF_CLASS_PAGE 16  // 页分配的类型编号: PROF_CLASS_PAGE + 阶数
+#define PROF_TOP 16         // 打印的调用点数量
+
+// 调用点统计
+// 对象可能在另一个CPU上释放, 所以单个CPU上的live可能为负, 全局存活量为各CPU之和
+typedef struct ProfSite {
+    u64 caller;  // 调用点 (返回地址), 0表示空槽
+    u8 cls;      // 大小类型: Slab分配器编号, 或PROF_CLASS_PAGE + 阶数
+    u64 allocs;  // 分配次数
+    u64 frees;   // 释放次数
+    u64 bytes;   // 累计分配字节数
+    isize live;  // 存活字节数 (本CPU记账部分)
+    isize peak;  // 存活字节数峰值 (本CPU记账部分)
+} ProfSite;
+
+// 每个CPU的调用点表
+typedef struct ProfTable {
+    ProfSite sites[PROF_SITES];
+    u64 dropped; // 表满时丢弃的记录数
+} __attribute__((aligned(64))) ProfTable;
+
+static ProfTable prof_table[NCPU];
+
+// 记录一次分配(bytes > 0)或释放(bytes < 0), 只写本CPU的表
+static void __prof_record(u64 caller, u8 cls, isize bytes)
+{
+    bool trap = _arch_disable_trap(); //*
+    auto t = &prof_table[cpuid()];
+
+    u64 h = ((caller >> 2) ^ cls) % PROF_SITES;
+    for (int n = 0; n < PROF_SITES; n++, h = (h + 1) % PROF_SITES) {
+        auto site = &t->sites[h];
+
+        // 空槽: 登记新的调用点
+        if (site->caller == 0) {
+            site->caller = caller;
+            site->cls = cls;
+        }
+
+        if (site->caller == caller && site->cls == cls) {
+            if (bytes > 0) {
+                site->allocs++;
+                site->bytes += bytes;
+            } else
+                site->frees++;
+            site->live += bytes;
+            if (site->live > site->peak)
+                site->peak = site->live;
+
+            if (trap)
+                _arch_enable_trap(); //*
+            return;
+        }
+    }
+
+    t->dropped++;
+
+    if (trap)
+        _arch_enable_trap(); //*
+}
+
+// 记录页分配的调用点 (存放在首页的描述符中, 释放时取回)
+static void __prof_page_alloc(void* p, int order, u64 caller)
+{
+    page_info[PFN(p)].caller = caller;
+    __prof_record(caller, PROF_CLASS_PAGE + order, (isize)PAGE_SIZE << order);
+}
+
+static void __prof_page_free(void* p, int order)
+{
+    __prof_record(page_info[PFN(p)].caller, PROF_CLASS_PAGE + order,
+        -((isize)PAGE_SIZE << order));
+}
+#endif
+
+#define OBJ_CACHE_MAX 32   // 每个CPU每种分配器最多缓存的对象数
+#define OBJ_CACHE_BATCH 16 // 与Slab页批量交换的对象数
+
+// 每个CPU每种分配器的对象缓存 (magazine, 栈式)
+typedef struct ObjCache {
+    int cnt;                   // 缓存对象数量
+    void* objs[OBJ_CACHE_MAX]; // 缓存对象栈
+} __attribute__((aligned(64))) ObjCache;
 
 // Slab分配器 (静态数组)
-typedef struct SlabAlloc {
+// 前SA_TYPES个是kalloc使用的通用分配器, 其后是kmem_cache_create创建的命名对象缓存
+struct SlabAlloc {
     SpinLock sa_lock; // 分配器锁
     ListNode partial;   // 部分页链表
     ListNode full;      // 完全页链表
-    u16 obj_size;       // 对象长度
-} SlabAlloc;
+    ListNode empty;     // 空页链表 (最多保留SLAB_RESERVE页)
+    int empty_cnt;      // 空页数量
+    u16 obj_size;       // 对象长度 (按对齐向上取整)
+    u16 obj_offset;     // 首对象在Slab页中的偏移 (按对齐向上取整)
+    const char* name;   // 分配器名称
+    void (*ctor)(void*); // 对象构造函数 (新建Slab页时调用)
+    void (*dtor)(void*); // 对象析构函数 (归还Slab页时调用)
+    ObjCache cpu_cache[NCPU]; // 每个CPU的对象缓存
+};
 
-#define SA_TYPES 32 // Slab分配器种类数
-static SlabAlloc SA[SA_TYPES];
+#define SA_TYPES 12 // 通用Slab分配器种类数
 static const u16 SA_SIZES[SA_TYPES]
     = { 2, 4, 8, 16, 32, 64, 128, 256, 512, 1016, 2032, 4072 };
 
+#define KMEM_CACHE_MAX 16 // 命名对象缓存的最大数量
+static SlabAlloc SA[SA_TYPES + KMEM_CACHE_MAX];
+static int kmem_cache_cnt; // 已创建的命名对象缓存数量 (需持有kmem_cache_lock)
+static SpinLock kmem_cache_lock;
+
+// 调试模式下每个对象槽的布局:
+// [左红区][对象][右红区][分配者地址][释放者地址]
+// 空闲链表写在左红区的前2字节, 不会覆盖对象内容
+#ifdef SLAB_DEBUG
+#define SLAB_REDZONE 8                                           // 红区长度
+#define SLAB_DEBUG_EXTRA (2 * SLAB_REDZONE + 2 * sizeof(u64))     // 每个槽的额外长度
+#define SLAB_MAP_WORDS ((PAGE_SIZE / SLAB_DEBUG_EXTRA + 63) / 64) // 已分配位图的字数
+#define REDZONE_BYTE 0xbb // 红区填充值
+#define POISON_FREE 0x6b  // 空闲对象填充值
+#define POISON_ALLOC 0xa5 // 新分配对象填充值
+#else
+#define SLAB_REDZONE 0
+#define SLAB_DEBUG_EXTRA 0
+#endif
+
+#define SLOT_SIZE(sa) ((sa)->obj_size + SLAB_DEBUG_EXTRA)        // 对象槽长度
+#define SLOT2OBJ(slot) ((void*)((u64)(slot) + SLAB_REDZONE)) // 对象槽 -> 对象
+#define OBJ2SLOT(obj) ((void*)((u64)(obj) - SLAB_REDZONE))   // 对象 -> 对象槽
+
 // Slab页 (双向链表)
 typedef struct SlabPage {
     u8 sa_type;               // 所属的分配器类型
     u16 obj_cnt;              // 已分配对象数量
     u16 free_obj_offset; // 首对象偏移位置
     ListNode node;            // 串在页链表中的结点
+#ifdef SLAB_DEBUG
+    u64 alloc_map[SLAB_MAP_WORDS]; // 已分配位图 (按对象槽编号)
+#endif
 } SlabPage;
 
 // Slab对象 (单向链表)
+// 对象空闲时前2字节被链表覆盖, 构造函数初始化的状态不应放在这里
 typedef struct SlabObj {
     u16 next_offset; // (2字节)
 } SlabObj;
 
+// 将页号为pfn的k阶块挂到空闲链表 (需持有kalloc_page_lock)
+static void __free_area_add(u64 pfn, int order)
+{
+    page_info[pfn].order = order;
+    page_info[pfn].flags |= PG_FREE;
+    _insert_into_list(&free_area[order].list, (ListNode*)PFN2PAGE(pfn));
+    free_area[order].cnt++;
+}
+
+// 将页号为pfn的k阶块从空闲链表摘下 (需持有kalloc_page_lock)
+static void __free_area_del(u64 pfn, int order)
+{
+    page_info[pfn].flags &= ~PG_FREE;
+    _detach_from_list((ListNode*)PFN2PAGE(pfn));
+    free_area[order].cnt--;
+}
+
+static void __buddy_free(u64 pfn, int order);
+
+// 从高水位线切出一个对齐的最大块交给伙伴系统 (需持有kalloc_page_lock)
+// 如果物理内存已全部切完, 则返回false
+static bool __buddy_grow()
+{
+    if (heap_pfn >= NPAGES)
+        return false;
+
+    // 选取首页对齐且不越过PHYSTOP的最大阶
+    int k = MAX_ORDER;
+    while ((heap_pfn & ((1ull << k) - 1)) || heap_pfn + (1ull << k) > NPAGES)
+        k--;
+
+    // 只初始化新块的描述符, 而不是在启动时遍历全部内存
+    u64 pfn = heap_pfn;
+    memset(&page_info[pfn], 0, (1ull << k) * sizeof(PageInfo));
+    heap_pfn += 1ull << k;
+
+    __buddy_free(pfn, k);
+    return true;
+}
+
+// 从伙伴系统分配一个k阶块, 失败返回NULL (需持有kalloc_page_lock)
+static void* __buddy_alloc(int order)
+{
+    // 找到不小于order的最小非空阶, 找不到则从高水位线继续切块
+    int k;
+    for (;;) {
+        k = order;
+        while (k <= MAX_ORDER && _empty_list(&free_area[k].list))
+            k++;
+        if (k <= MAX_ORDER)
+            break;
+        if (!__buddy_grow())
+            return NULL;
+    }
+
+    u64 pfn = PFN(free_area[k].list.next);
+    __free_area_del(pfn, k);
+
+    // 逐级对半拆分, 把高地址的一半(伙伴)放回低一阶的链表
+    while (k > order) {
+        k--;
+        __free_area_add(pfn + (1ull << k), k);
+    }
+
+    return PFN2PAGE(pfn);
+}
+
+// 向伙伴系统释放一个k阶块, 并与空闲伙伴逐级合并 (需持有kalloc_page_lock)
+static void __buddy_free(u64 pfn, int order)
+{
+    while (order < MAX_ORDER) {
+        u64 buddy = pfn ^ (1ull << order);
+
+        // 伙伴必须是高水位线以下的同阶空闲块才能合并
+        if (buddy >= heap_pfn || !(page_info[buddy].flags & PG_FREE)
+            || page_info[buddy].order != order)
+            break;
+
+        __free_area_del(buddy, order);
+        pfn &= ~(1ull << order);
+        order++;
+    }
+
+    __free_area_add(pfn, order);
+}
+
+// 初始化Slab分配器
+static void __slab_init(SlabAlloc* sa, const char* name, u16 size, u16 align,
+    void (*ctor)(void*), void (*dtor)(void*))
+{
+    init_spinlock(&sa->sa_lock);
+    init_list_node(&sa->partial);
+    init_list_node(&sa->full);
+    init_list_node(&sa->empty);
+    sa->empty_cnt = 0;
+    sa->obj_size = round_up(MAX(size, sizeof(SlabObj)), align);
+    sa->obj_offset = round_up(sizeof(SlabPage), align);
+    sa->name = name;
+    sa->ctor = ctor;
+    sa->dtor = dtor;
+    for (int i = 0; i < NCPU; i++)
+        sa->cpu_cache[i].cnt = 0;
+}
+
 void kinit()
 {
-    init_rc(&kalloc_page_cnt);
+    u64 t0 = get_timestamp();
+
     init_spinlock(&kalloc_page_lock);
 
-    // 空闲页链表的初始地址: end关于PAGE_SIZE的对齐
-    free_page_head = (struct FreePage*)round_up((u64)end, PAGE_SIZE);
+    // 物理页描述符数组的地址: end关于PAGE_SIZE的对齐
+    page_info = (PageInfo*)round_up((u64)end, PAGE_SIZE);
 
-    // 初始化页空闲链表
-    auto p = (u64)free_page_head;
-    auto page = (struct FreePage*)p;
-    for (; p < P2K(PHYSTOP); p += PAGE_SIZE) {
-        page = (struct FreePage*)p;
-        page->next = (struct FreePage*)(p + PAGE_SIZE);
+    for (int k = 0; k <= MAX_ORDER; k++) {
+        init_list_node(&free_area[k].list);
+        free_area[k].cnt = 0;
+    }
+
+    // 描述符数组之后的页按需交给伙伴系统, 此处只初始化高水位线以下的描述符
+    heap_pfn = PFN(round_up((u64)(page_info + NPAGES), PAGE_SIZE));
+    memset(page_info, 0, heap_pfn * sizeof(PageInfo));
+
+    // 初始化所有通用Slab分配器 (对象长度本身保证了对齐)
+    for (int i = 0; i < SA_TYPES; i++)
+        __slab_init(&SA[i], "kalloc", SA_SIZES[i], 2, NULL, NULL);
+
+    init_spinlock(&kmem_cache_lock);
+    kmem_cache_cnt = 0;
+
+    printk("kinit: %llu us\n", (get_timestamp() - t0) * 1000000 / get_clock_frequency());
+}
+
+// 从伙伴系统批量取页, 填充本CPU的页缓存 (需关闭中断)
+static void __page_cache_refill(PageCache* pc)
+{
+    acquire_spinlock(&kalloc_page_lock); //*
+
+    while (pc->cnt < PAGE_CACHE_BATCH) {
+        FreePage* page = __buddy_alloc(0);
+        if (page == NULL)
+            break;
+        page->next = pc->head;
+        pc->head = page;
+        pc->cnt++;
     }
-    page->next = NULL; // 末尾页的next指针为NULL
 
-    // 初始化所有Slab分配器
-    for (int i = 0; i < SA_TYPES; i++) {
-        init_spinlock(&SA[i].sa_lock);
-        SA[i].obj_size = SA_SIZES[i];
-        init_list_node(&SA[i].partial);
-        init_list_node(&SA[i].full);
+    release_spinlock(&kalloc_page_lock); //*
+}
+
+// 将本CPU页缓存中的一批页归还伙伴系统 (需关闭中断)
+static void __page_cache_drain(PageCache* pc)
+{
+    acquire_spinlock(&kalloc_page_lock); //*
+
+    for (int i = 0; i < PAGE_CACHE_BATCH && pc->head != NULL; i++) {
+        auto page = pc->head;
+        pc->head = page->next;
+        pc->cnt--;
+        __buddy_free(PFN(page), 0);
     }
+
+    release_spinlock(&kalloc_page_lock); //*
 }
 
-// 直接分配一页
-void* kalloc_page()
+// 从本CPU页缓存分配一页
+static void* __kalloc_page()
 {
-    increment_rc(&kalloc_page_cnt);
-    acquire_spinlock(&kalloc_page_lock);
+    // 关闭中断, 防止访问页缓存时被调度到其他CPU
+    bool trap = _arch_disable_trap(); //*
+    auto pc = &page_cache[cpuid()];
 
-    auto page = free_page_head;
-    free_page_head = free_page_head->next;
+    // 如果本CPU页缓存为空, 则从全局链表批量取页
+    if (pc->head == NULL)
+        __page_cache_refill(pc);
 
-    release_spinlock(&kalloc_page_lock);
+    // 伙伴系统也耗尽时, 动用预清零页
+    if (pc->head == NULL && pc->zero_head != NULL) {
+        pc->head = pc->zero_head;
+        pc->cnt = pc->zero_cnt;
+        pc->zero_head = NULL;
+        pc->zero_cnt = 0;
+    }
 
+    auto page = pc->head;
     ASSERT(page != NULL);
+    pc->head = page->next;
+    pc->cnt--;
+    pc->page_cnt++;
+
+    if (trap)
+        _arch_enable_trap(); //*
     return page;
 }
 
-// 直接释放一页 (需要页对齐)
-void kfree_page(void* p)
+// 释放一页到本CPU页缓存
+static void __kfree_page(void* p)
 {
     // 确保地址页对齐
     ASSERT(((u64)p & (PAGE_SIZE - 1)) == 0);
 
-    decrement_rc(&kalloc_page_cnt);
-    acquire_spinlock(&kalloc_page_lock);
+    bool trap = _arch_disable_trap(); //*
+    auto pc = &page_cache[cpuid()];
 
     auto page = (struct FreePage*)p;
-    page->next = free_page_head;
-    free_page_head = page;
+    page->next = pc->head;
+    pc->head = page;
+    pc->cnt++;
+    pc->page_cnt--;
 
-    release_spinlock(&kalloc_page_lock);
-    return;
+    // 如果本CPU页缓存已满, 则批量归还全局链表
+    if (pc->cnt >= PAGE_CACHE_MAX)
+        __page_cache_drain(pc);
+
+    if (trap)
+        _arch_enable_trap(); //*
 }
 
-void* kalloc(unsigned long long size)
+// 直接分配一页
+void* kalloc_page()
 {
-    for (int i = 0; i < SA_TYPES; i++) {
-        if (size > SA[i].obj_size)
-            continue; // 如果分配器过短，则跳过
-
-        acquire_spinlock(&SA[i].sa_lock);
-
-        // 从部分页链表中取出一页
-        SlabPage* page = container_of(SA[i].partial.next, SlabPage, node);
-
-        // 如果没有可用页，则分配新页
-        if (_empty_list(&SA[i].partial)) {
-            page = (SlabPage*)kalloc_page();
-            memset(page, 0, PAGE_SIZE);
-            page->sa_type = i;           // 所属分配器类型
-            page->obj_cnt = 0;           // 无已分配对象
-            init_list_node(&page->node); // 初始化链表节点
-
-            // 首对象 偏移位置 (地址对齐)
-            page->free_obj_offset = sizeof(SlabPage);
-
-            // 初始化 对象链表
-            u16 obj_offset = page->free_obj_offset;
-            auto obj = (SlabObj*)((u64)page + obj_offset);
-            for (; obj_offset <= PAGE_SIZE - SA[i].obj_size;
-                 obj_offset += SA[i].obj_size) {
-                obj = (SlabObj*)((u64)page + obj_offset);
-                obj->next_offset = obj_offset + SA[i].obj_size;
-            }
-            obj->next_offset = NULL; // 末尾对象的next指针为NULL
+    void* page = __kalloc_page();
+#ifdef KALLOC_PROFILE
+    __prof_page_alloc(page, 0, (u64)__builtin_return_address(0));
+#endif
+    return page;
+}
 
-            // 更新 部分链表首页
-            _insert_into_list(&SA[i].partial, &page->node);
-        }
+// 直接释放一页 (需要页对齐)
+void kfree_page(void* p)
+{
+#ifdef KALLOC_PROFILE
+    __prof_page_free(p, 0);
+#endif
+    __kfree_page(p);
+}
 
-        auto obj = (SlabObj*)((u64)page + page->free_obj_offset);
-        page->free_obj_offset = obj->next_offset;
-        page->obj_cnt++;
+// 分配一页已清零的页, 优先从本CPU的预清零页池中取
+void* kalloc_page_zeroed()
+{
+    bool trap = _arch_disable_trap(); //*
+    auto pc = &page_cache[cpuid()];
 
-        // 如果页已满，则从部分链表移至完全链表
-        if (page->free_obj_offset == NULL) {
-            _detach_from_list(&page->node);
-            _insert_into_list(&SA[i].full, &page->node);
-        }
+    auto page = pc->zero_head;
+    if (page != NULL) {
+        pc->zero_head = page->next;
+        pc->zero_cnt--;
+        pc->page_cnt++;
+        page->next = NULL; // 只有链表指针需要清零
+    }
+
+    if (trap)
+        _arch_enable_trap(); //*
+
+    if (page == NULL) {
+        page = __kalloc_page();
+        memset(page, 0, PAGE_SIZE);
+    }
+
+#ifdef KALLOC_PROFILE
+    __prof_page_alloc(page, 0, (u64)__builtin_return_address(0));
+#endif
+    return page;
+}
+
+// 由空闲的CPU调用: 清零一页放入本CPU的预清零页池
+// 返回false表示页池已满或没有空闲页, 无事可做
+bool kalloc_zero_fill()
+{
+    bool trap = _arch_disable_trap(); //*
+    auto pc = &page_cache[cpuid()];
 
-        release_spinlock(&SA[i].sa_lock);
-        return obj;
+    if (pc->zero_cnt >= ZERO_POOL_MAX) {
+        if (trap)
+            _arch_enable_trap(); //*
+        return false;
     }
 
-    printk("kalloc: out of memory\n");
+    // 从页缓存取一页 (不计入已分配页数)
+    if (pc->head == NULL)
+        __page_cache_refill(pc);
+    auto page = pc->head;
+    if (page != NULL) {
+        pc->head = page->next;
+        pc->cnt--;
+    }
+
+    if (trap)
+        _arch_enable_trap(); //*
+
+    if (page == NULL)
+        return false;
+
+    // 清零时开中断, 以免推迟时钟中断和调度
+    memset(page, 0, PAGE_SIZE);
+
+    trap = _arch_disable_trap(); //*
+    pc = &page_cache[cpuid()];
+    page->next = pc->zero_head;
+    pc->zero_head = page;
+    pc->zero_cnt++;
+    if (trap)
+        _arch_enable_trap(); //*
+
+    return true;
+}
+
+// 分配 2^order 个物理连续的页 (首地址对齐到 PAGE_SIZE << order)
+// 如果没有足够大的连续块, 则返回NULL
+static void* __kalloc_pages(int order)
+{
+    ASSERT(order >= 0 && order <= MAX_ORDER);
+
+    void* page;
+
+    // 单页走本CPU页缓存
+    if (order == 0)
+        page = __kalloc_page();
+
+    else {
+        bool trap = _arch_disable_trap(); //*
+
+        acquire_spinlock(&kalloc_page_lock); //**
+        page = __buddy_alloc(order);
+        release_spinlock(&kalloc_page_lock); //**
+
+        if (page != NULL)
+            page_cache[cpuid()].page_cnt += 1ll << order;
+
+        if (trap)
+            _arch_enable_trap(); //*
+    }
+
+    return page;
+}
+
+// 对外接口, 剖析模式下按调用点记账
+void* kalloc_pages(int order)
+{
+    void* page = __kalloc_pages(order);
+#ifdef KALLOC_PROFILE
+    if (page != NULL)
+        __prof_page_alloc(page, order, (u64)__builtin_return_address(0));
+#endif
+    return page;
+}
+
+// 释放 kalloc_pages(order) 分配的连续页
+static void __kfree_pages(void* p, int order)
+{
+    ASSERT(order >= 0 && order <= MAX_ORDER);
+    ASSERT(((u64)p & ((PAGE_SIZE << order) - 1)) == 0);
+
+    if (order == 0) {
+        __kfree_page(p);
+        return;
+    }
+
+    bool trap = _arch_disable_trap(); //*
+
+    acquire_spinlock(&kalloc_page_lock); //**
+    __buddy_free(PFN(p), order);
+    release_spinlock(&kalloc_page_lock); //**
+
+    page_cache[cpuid()].page_cnt -= 1ll << order;
+
+    if (trap)
+        _arch_enable_trap(); //*
+}
+
+// 对外接口, 剖析模式下按调用点记账
+void kfree_pages(void* p, int order)
+{
+#ifdef KALLOC_PROFILE
+    __prof_page_free(p, order);
+#endif
+    __kfree_pages(p, order);
+}
+
+// 返回当前已分配的页数 (所有CPU计数之和)
+isize kalloc_page_cnt()
+{
+    isize cnt = 0;
+    for (int i = 0; i < NCPU; i++)
+        cnt += page_cache[i].page_cnt;
+    return cnt;
+}
+
+// 打印伙伴系统的碎片统计信息
+void kalloc_page_stat()
+{
+    usize free_pages = 0, cached_pages = 0, zeroed_pages = 0;
+    int largest = -1;
+
+    acquire_spinlock(&kalloc_page_lock); //*
+
+    for (int k = 0; k <= MAX_ORDER; k++) {
+        usize cnt = free_area[k].cnt;
+        printk("buddy: order %d: %llu blocks (%llu pages)\n", k, cnt, cnt << k);
+        free_pages += cnt << k;
+        if (cnt > 0)
+            largest = k;
+    }
+
+    // 小于2MiB(9阶)的空闲块无法满足大块分配, 其占比即为碎片化程度
+    usize small_pages = 0;
+    for (int k = 0; k < 9 && k <= MAX_ORDER; k++)
+        small_pages += free_area[k].cnt << k;
+
+    release_spinlock(&kalloc_page_lock); //*
+
+    for (int i = 0; i < NCPU; i++) {
+        cached_pages += page_cache[i].cnt;
+        zeroed_pages += page_cache[i].zero_cnt;
+    }
+
+    printk("buddy: free %llu pages, cached %llu pages, zeroed %llu pages, largest order %d\n",
+        free_pages, cached_pages, zeroed_pages, largest);
+    printk("buddy: %llu%% of free pages are in blocks below order 9\n",
+        free_pages ? small_pages * 100 / free_pages : 0);
+    printk("buddy: %llu of %llu pages handed to the buddy system\n", heap_pfn, NPAGES);
+    spinlock_stat("kalloc_page_lock", &kalloc_page_lock);
+}
+
+// O(1) 计算能容纳size字节的最小分配器类型, 超过最大对象则返回-1
+static int __sa_type(u64 size)
+{
+    if (size <= SA_SIZES[0])
+        return 0;
+    if (size > SA_SIZES[SA_TYPES - 1])
+        return -1;
+
+    // 向上取整到2的幂: 2^(i+1) >= size > 2^i
+    // 后三种分配器略小于2的幂 (需扣除Slab页头), 此时可能需要再进一级
+    int i = 63 - __builtin_clzll(size - 1);
+    if (size > SA_SIZES[i])
+        i++;
+    return i;
+}
+
+#ifdef SLAB_DEBUG
+// 返回对象槽末尾记录的调用者地址: [0]分配者 [1]释放者
+static u8* __slot_callers(SlabAlloc* sa, void* slot)
+{
+    return (u8*)slot + SLAB_REDZONE + sa->obj_size + SLAB_REDZONE;
+}
+
+// 报告Slab错误并停机
+static NO_RETURN void __debug_report(SlabAlloc* sa, void* slot, const char* msg, u64 caller)
+{
+    u64 callers[2];
+    memcpy(callers, __slot_callers(sa, slot), sizeof(callers));
+    printk("slab %s: %s, object %p, caller %p, last alloc %p, last free %p\n", sa->name,
+        msg, SLOT2OBJ(slot), (void*)caller, (void*)callers[0], (void*)callers[1]);
     PANIC();
-    return NULL;
 }
 
-void kfree(void* ptr)
+// 初始化新Slab页中的对象槽: 填充红区, 毒化对象 (有构造函数的对象不毒化)
+static void __debug_init_slot(SlabAlloc* sa, void* slot)
+{
+    u8* obj = SLOT2OBJ(slot);
+    memset(slot, REDZONE_BYTE, SLAB_REDZONE);
+    if (sa->ctor == NULL)
+        memset(obj, POISON_FREE, sa->obj_size);
+    memset(obj + sa->obj_size, REDZONE_BYTE, SLAB_REDZONE);
+    memset(__slot_callers(sa, slot), 0, 2 * sizeof(u64));
+}
+
+// 检查对象两侧的红区 (左红区的前2字节可能存放空闲链表)
+static void __debug_check_redzone(SlabAlloc* sa, void* slot, u64 caller)
+{
+    u8* left = slot;
+    u8* right = (u8*)SLOT2OBJ(slot) + sa->obj_size;
+    for (usize i = sizeof(SlabObj); i < SLAB_REDZONE; i++)
+        if (left[i] != REDZONE_BYTE)
+            __debug_report(sa, slot, "left redzone overwritten", caller);
+    for (usize i = 0; i < SLAB_REDZONE; i++)
+        if (right[i] != REDZONE_BYTE)
+            __debug_report(sa, slot, "right redzone overwritten", caller);
+}
+
+// 返回对象槽在Slab页中的编号, 非法的对象槽地址则报错
+static u64 __debug_slot_index(SlabAlloc* sa, void* slot, u64 caller)
+{
+    u64 off = (u64)slot - PAGE_BASE((u64)slot);
+    if (off < sa->obj_offset || (off - sa->obj_offset) % SLOT_SIZE(sa) != 0
+        || off + SLOT_SIZE(sa) > PAGE_SIZE)
+        __debug_report(sa, slot, "invalid pointer", caller);
+    return (off - sa->obj_offset) / SLOT_SIZE(sa);
+}
+
+// 分配调试: 标记已分配, 检查红区和释放后写入, 记录分配者
+static void* __debug_alloc(SlabAlloc* sa, void* slot, u64 caller)
+{
+    auto page = (SlabPage*)PAGE_BASE((u64)slot);
+    u64 idx = __debug_slot_index(sa, slot, caller);
+    u8* obj = SLOT2OBJ(slot);
+
+    u64 old = __atomic_fetch_or(&page->alloc_map[idx / 64], BIT(idx % 64), __ATOMIC_ACQ_REL);
+    if (old & BIT(idx % 64))
+        __debug_report(sa, slot, "object allocated twice", caller);
+
+    __debug_check_redzone(sa, slot, caller);
+
+    if (sa->ctor == NULL) {
+        for (usize i = 0; i < sa->obj_size; i++)
+            if (obj[i] != POISON_FREE)
+                __debug_report(sa, slot, "write after free", caller);
+        memset(obj, POISON_ALLOC, sa->obj_size);
+    }
+
+    memcpy(__slot_callers(sa, slot), &caller, sizeof(u64));
+    return obj;
+}
+
+// 释放调试: 检查重复释放和越界写入, 毒化对象, 记录释放者
+static void* __debug_free(SlabAlloc* sa, void* ptr, u64 caller)
+{
+    void* slot = OBJ2SLOT(ptr);
+    auto page = (SlabPage*)PAGE_BASE((u64)slot);
+    u64 idx = __debug_slot_index(sa, slot, caller);
+
+    u64 old = __atomic_fetch_and(&page->alloc_map[idx / 64], ~BIT(idx % 64), __ATOMIC_ACQ_REL);
+    if (!(old & BIT(idx % 64)))
+        __debug_report(sa, slot, "double free", caller);
+
+    __debug_check_redzone(sa, slot, caller);
+
+    if (sa->ctor == NULL)
+        memset(ptr, POISON_FREE, sa->obj_size);
+
+    memcpy(__slot_callers(sa, slot) + sizeof(u64), &caller, sizeof(u64));
+    return slot;
+}
+#endif
+
+// 从Slab页中取出一个对象 (需持有sa_lock)
+static void* __slab_alloc(SlabAlloc* sa)
+{
+    // 从部分页链表中取出一页
+    SlabPage* page = container_of(sa->partial.next, SlabPage, node);
+
+    // 如果没有部分页, 则优先复用保留的空页
+    if (_empty_list(&sa->partial) && !_empty_list(&sa->empty)) {
+        page = container_of(sa->empty.next, SlabPage, node);
+        _detach_from_list(&page->node);
+        _insert_into_list(&sa->partial, &page->node);
+        sa->empty_cnt--;
+    }
+
+    // 如果没有可用页，则分配新页
+    if (_empty_list(&sa->partial)) {
+        page = (SlabPage*)kalloc_page_zeroed();
+        page->sa_type = sa - SA;     // 所属分配器类型
+        page->obj_cnt = 0;           // 无已分配对象
+        init_list_node(&page->node); // 初始化链表节点
+
+        // 首对象 偏移位置 (地址对齐)
+        page->free_obj_offset = sa->obj_offset;
+
+        // 初始化 对象链表 (先构造对象, 再写入链表)
+        u16 obj_offset = page->free_obj_offset;
+        auto obj = (SlabObj*)((u64)page + obj_offset);
+        for (; obj_offset <= PAGE_SIZE - SLOT_SIZE(sa); obj_offset += SLOT_SIZE(sa)) {
+            obj = (SlabObj*)((u64)page + obj_offset);
+#ifdef SLAB_DEBUG
+            __debug_init_slot(sa, obj);
+#endif
+            if (sa->ctor)
+                sa->ctor(SLOT2OBJ(obj));
+            obj->next_offset = obj_offset + SLOT_SIZE(sa);
+        }
+        obj->next_offset = NULL; // 末尾对象的next指针为NULL
+
+        // 更新 部分链表首页
+        _insert_into_list(&sa->partial, &page->node);
+    }
+
+    auto obj = (SlabObj*)((u64)page + page->free_obj_offset);
+    page->free_obj_offset = obj->next_offset;
+    page->obj_cnt++;
+
+    // 如果页已满，则从部分链表移至完全链表
+    if (page->free_obj_offset == NULL) {
+        _detach_from_list(&page->node);
+        _insert_into_list(&sa->full, &page->node);
+    }
+
+    return obj;
+}
+
+// 将对象放回所属的Slab页 (需持有sa_lock)
+static void __slab_free(SlabAlloc* sa, void* ptr)
 {
     auto obj = (SlabObj*)ptr;
     auto page = (SlabPage*)PAGE_BASE((u64)obj);
 
-    acquire_spinlock(&SA[page->sa_type].sa_lock);
-
     obj->next_offset = page->free_obj_offset;
     page->free_obj_offset = (u16)((u64)obj - (u64)page);
     page->obj_cnt--;
 
+    // 如果页已空, 则保留到空页链表, 超出保留数量的空页归还页分配器
+    if (page->obj_cnt == 0) {
+        _detach_from_list(&page->node);
+        if (sa->empty_cnt < SLAB_RESERVE) {
+            _insert_into_list(&sa->empty, &page->node);
+            sa->empty_cnt++;
+        } else {
+            // 归还前析构页内的所有对象
+            if (sa->dtor) {
+                for (u16 off = sa->obj_offset; off <= PAGE_SIZE - SLOT_SIZE(sa);
+                     off += SLOT_SIZE(sa))
+                    sa->dtor(SLOT2OBJ((u64)page + off));
+            }
+            kfree_page(page);
+        }
+    }
+
     // 如果此时页在完全链表, 则将其移至部分链表
-    if (obj->next_offset == NULL) {
+    else if (obj->next_offset == NULL) {
         _detach_from_list(&page->node);
-        _insert_into_list(&SA[page->sa_type].partial, &page->node);
+        _insert_into_list(&sa->partial, &page->node);
+    }
+}
+
+// 从本CPU对象缓存中取出一个对象
+static void* __cache_alloc(SlabAlloc* sa)
+{
+    // 关闭中断, 防止访问对象缓存时被调度到其他CPU
+    bool trap = _arch_disable_trap(); //*
+    auto oc = &sa->cpu_cache[cpuid()];
+
+    // 如果本CPU对象缓存为空, 则从Slab页批量取对象
+    if (oc->cnt == 0) {
+        acquire_spinlock(&sa->sa_lock); //**
+        while (oc->cnt < OBJ_CACHE_BATCH)
+            oc->objs[oc->cnt++] = __slab_alloc(sa);
+        release_spinlock(&sa->sa_lock); //**
+    }
+
+    void* obj = oc->objs[--oc->cnt];
+
+    if (trap)
+        _arch_enable_trap(); //*
+    return obj;
+}
+
+// 将对象放入本CPU对象缓存
+static void __cache_free(SlabAlloc* sa, void* ptr)
+{
+    bool trap = _arch_disable_trap(); //*
+    auto oc = &sa->cpu_cache[cpuid()];
+
+    // 如果本CPU对象缓存已满, 则批量放回Slab页
+    if (oc->cnt == OBJ_CACHE_MAX) {
+        acquire_spinlock(&sa->sa_lock); //**
+        while (oc->cnt > OBJ_CACHE_MAX - OBJ_CACHE_BATCH)
+            __slab_free(sa, oc->objs[--oc->cnt]);
+        release_spinlock(&sa->sa_lock); //**
+    }
+
+    oc->objs[oc->cnt++] = ptr;
+
+    if (trap)
+        _arch_enable_trap(); //*
+}
+
+// 分配大对象: 直接使用伙伴系统的连续页, 并在页描述符中记录阶数
+static void* __kalloc_large(u64 size)
+{
+    // 计算能容纳size字节的最小阶数
+    int order = 0;
+    while (order <= MAX_ORDER && ((u64)PAGE_SIZE << order) < size)
+        order++;
+    if (order > MAX_ORDER)
+        return NULL;
+
+    // 不经过kalloc_pages记账, 大对象由kalloc按调用点统计一次
+    void* p = __kalloc_pages(order);
+    if (p == NULL)
+        return NULL;
+
+    page_info[PFN(p)].order = order;
+    page_info[PFN(p)].flags |= PG_LARGE;
+    return p;
+}
+
+// 释放大对象
+static void __kfree_large(void* p)
+{
+    auto info = &page_info[PFN(p)];
+    ASSERT(info->flags & PG_LARGE);
+    info->flags &= ~PG_LARGE;
+    __kfree_pages(p, info->order);
+}
+
+static void* __kalloc(u64 size, u64 caller)
+{
+    void* obj;
+
+    int i = __sa_type(size);
+
+#ifdef SLAB_DEBUG
+    // 加上红区后放不进一页的对象改走大对象路径
+    if (i >= 0 && SA[i].obj_offset + SLOT_SIZE(&SA[i]) > PAGE_SIZE)
+        i = -1;
+#endif
+
+    if (i >= 0) {
+        obj = __cache_alloc(&SA[i]);
+#ifdef SLAB_DEBUG
+        obj = __debug_alloc(&SA[i], obj, caller);
+#else
+        (void)caller;
+#endif
+    } else
+        obj = __kalloc_large(size);
+
+    if (obj == NULL) {
+        printk("kalloc: out of memory\n");
+        PANIC();
+    }
+    return obj;
+}
+
+static void __kfree(void* ptr, u64 caller)
+{
+    // Slab对象位于页头之后, 不会页对齐; 页对齐的指针只能是大对象
+    if (PAGE_BASE(ptr) == (u64)ptr) {
+        __kfree_large(ptr);
+        return;
+    }
+
+    auto page = (SlabPage*)PAGE_BASE((u64)ptr);
+#ifdef SLAB_DEBUG
+    ptr = __debug_free(&SA[page->sa_type], ptr, caller);
+#else
+    (void)caller;
+#endif
+    __cache_free(&SA[page->sa_type], ptr);
+}
+
+#ifdef KALLOC_PROFILE
+// 返回kalloc得到的内存块实际占用的字节数及其大小类型
+static isize __ksize(void* ptr, u8* cls)
+{
+    if (PAGE_BASE(ptr) == (u64)ptr) {
+        int order = page_info[PFN(ptr)].order;
+        *cls = PROF_CLASS_PAGE + order;
+        return (isize)PAGE_SIZE << order;
+    }
+
+    int i = ((SlabPage*)PAGE_BASE((u64)ptr))->sa_type;
+    *cls = i;
+    return SA[i].obj_size;
+}
+#endif
+
+void* kalloc(unsigned long long size)
+{
+    u64 caller = (u64)__builtin_return_address(0);
+
+#ifdef KALLOC_PROFILE
+    // 剖析模式下在对象前放8字节的头部记录调用点, 释放时据此记账
+    u8 cls;
+    u64* hdr = __kalloc(size + sizeof(u64), caller);
+    *hdr = caller;
+    isize bytes = __ksize(hdr, &cls);
+    __prof_record(caller, cls, bytes);
+    return hdr + 1;
+#else
+    return __kalloc(size, caller);
+#endif
+}
+
+void kfree(void* ptr)
+{
+    u64 caller = (u64)__builtin_return_address(0);
+
+#ifdef KALLOC_PROFILE
+    u8 cls;
+    u64* hdr = (u64*)ptr - 1;
+    isize bytes = __ksize(hdr, &cls);
+    __prof_record(*hdr, cls, -bytes);
+    __kfree(hdr, caller);
+#else
+    __kfree(ptr, caller);
+#endif
+}
+
+// 创建命名对象缓存, 对象按align对齐 (align需为2的幂)
+// ctor在新建Slab页时对每个对象调用一次, 对象释放后应恢复到构造完成的状态
+// dtor在Slab页归还页分配器前对每个对象调用一次
+SlabAlloc* kmem_cache_create(const char* name, u16 size, u16 align,
+    void (*ctor)(void*), void (*dtor)(void*))
+{
+    ASSERT(align >= 2 && (align & (align - 1)) == 0);
+#ifdef SLAB_DEBUG
+    ASSERT(align <= SLAB_REDZONE); // 红区长度保证对象的对齐
+#endif
+
+    acquire_spinlock(&kmem_cache_lock); //*
+    ASSERT(kmem_cache_cnt < KMEM_CACHE_MAX);
+    auto sa = &SA[SA_TYPES + kmem_cache_cnt++];
+    release_spinlock(&kmem_cache_lock); //*
+
+    __slab_init(sa, name, size, align, ctor, dtor);
+
+    // 确保每页至少能放下一个对象
+    ASSERT(sa->obj_offset + SLOT_SIZE(sa) <= PAGE_SIZE);
+    return sa;
+}
+
+// 从对象缓存中分配一个已构造的对象
+void* kmem_cache_alloc(SlabAlloc* sa)
+{
+    void* obj = __cache_alloc(sa);
+#ifdef SLAB_DEBUG
+    obj = __debug_alloc(sa, obj, (u64)__builtin_return_address(0));
+#endif
+    return obj;
+}
+
+// 释放对象到对象缓存
+void kmem_cache_free(SlabAlloc* sa, void* ptr)
+{
+    ASSERT(&SA[((SlabPage*)PAGE_BASE((u64)ptr))->sa_type] == sa);
+#ifdef SLAB_DEBUG
+    ptr = __debug_free(sa, ptr, (u64)__builtin_return_address(0));
+#endif
+    __cache_free(sa, ptr);
+}
+
+// 将本CPU对象缓存中的对象全部放回Slab页, 使空页可以被回收
+void kalloc_drain()
+{
+    bool trap = _arch_disable_trap(); //*
+
+    for (int i = 0; i < SA_TYPES + kmem_cache_cnt; i++) {
+        auto oc = &SA[i].cpu_cache[cpuid()];
+        if (oc->cnt == 0)
+            continue;
+
+        acquire_spinlock(&SA[i].sa_lock); //**
+        while (oc->cnt > 0)
+            __slab_free(&SA[i], oc->objs[--oc->cnt]);
+        release_spinlock(&SA[i].sa_lock); //**
+    }
+
+    if (trap)
+        _arch_enable_trap(); //*
+}
+
+// 打印分配剖析结果: 按累计分配字节数排序的前PROF_TOP个调用点
+// 峰值为各CPU记账峰值之和, 是全局峰值的上界
+void kalloc_profile_dump()
+{
+#ifdef KALLOC_PROFILE
+    static ProfSite merged[NCPU * PROF_SITES];
+    static SpinLock dump_lock;
+    int n = 0;
+    u64 dropped = 0;
+
+    acquire_spinlock(&dump_lock); //*
+
+    // 合并所有CPU的调用点表
+    for (int c = 0; c < NCPU; c++) {
+        dropped += prof_table[c].dropped;
+        for (int h = 0; h < PROF_SITES; h++) {
+            auto site = &prof_table[c].sites[h];
+            if (site->caller == 0)
+                continue;
+
+            int k = 0;
+            while (k < n && (merged[k].caller != site->caller || merged[k].cls != site->cls))
+                k++;
+            if (k == n) {
+                merged[n] = *site;
+                n++;
+                continue;
+            }
+
+            merged[k].allocs += site->allocs;
+            merged[k].frees += site->frees;
+            merged[k].bytes += site->bytes;
+            merged[k].live += site->live;
+            merged[k].peak += site->peak;
+        }
+    }
+
+    printk("kalloc profile: %d sites, %llu records dropped\n", n, dropped);
+
+    // 选择排序出前PROF_TOP个
+    for (int i = 0; i < n && i < PROF_TOP; i++) {
+        int top = i;
+        for (int k = i + 1; k < n; k++)
+            if (merged[k].bytes > merged[top].bytes)
+                top = k;
+        auto t = merged[i];
+        merged[i] = merged[top];
+        merged[top] = t;
+
+        auto site = &merged[i];
+        if (site->cls >= PROF_CLASS_PAGE)
+            printk("0x%llx page order %d: ", site->caller, site->cls - PROF_CLASS_PAGE);
+        else
+            printk("0x%llx kalloc %d: ", site->caller, SA_SIZES[site->cls]);
+        printk("allocs %llu, frees %llu, bytes %llu, live %lld, peak %lld\n", site->allocs,
+            site->frees, site->bytes, site->live, site->peak);
     }
 
-    release_spinlock(&SA[page->sa_type].sa_lock);
-    return;
+    release_spinlock(&dump_lock); //*
+#else
+    printk("kalloc profile: disabled (define KALLOC_PROFILE in kernel/mem.c)\n");
+#endif
 }
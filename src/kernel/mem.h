@@ -1,9 +1,33 @@
 #pragma once
 
+#include <common/defines.h>
+
+// 伙伴系统的最大阶数 (2^10页 = 4MiB)
+#define MAX_ORDER 10
+
 void kinit();
 
 void* kalloc_page();
 void kfree_page(void*);
+void* kalloc_page_zeroed();
+bool kalloc_zero_fill();
+isize kalloc_page_cnt();
+
+void* kalloc_pages(int order);
+void kfree_pages(void*, int order);
+void kalloc_page_stat();
+
+// 每种Slab分配器最多保留的空页数, 其余空页归还页分配器
+#define SLAB_RESERVE 2
 
 void* kalloc(unsigned long long);
 void kfree(void*);
+void kalloc_drain();
+void kalloc_profile_dump();
+
+// 命名对象缓存
+typedef struct SlabAlloc SlabAlloc;
+SlabAlloc* kmem_cache_create(const char* name, u16 size, u16 align,
+    void (*ctor)(void*), void (*dtor)(void*));
+void* kmem_cache_alloc(SlabAlloc*);
+void kmem_cache_free(SlabAlloc*, void*);
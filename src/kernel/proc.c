@@ -16,6 +16,9 @@ void kernel_entry(); // root_proc 进程跳转到这里
 // 顺序分配pid (需要持有锁)
 static int nextpid = 1;
 
+// 进程结构体的对象缓存
+static SlabAlloc* proc_cache;
+
 // pid树
 static struct rb_root_ pid_root;
 static bool __pid_cmp(rb_node lnode, rb_node rnode)
@@ -23,12 +26,31 @@ static bool __pid_cmp(rb_node lnode, rb_node rnode)
     return container_of(lnode, Proc, _node)->pid < container_of(rnode, Proc, _node)->pid;
 }
 
+// 进程结构体的构造函数: 分配内核栈 (对象释放后保留, 复用时无需重新分配)
+// 内核栈为2页连续内存: 低页顶部存放初始用户上下文, 高页为内核上下文栈
+static void proc_ctor(void* obj)
+{
+    auto p = (Proc*)obj;
+    p->kstack = kalloc_pages(1);
+    ASSERT(p->kstack != NULL);
+}
+
+// 进程结构体的析构函数: 释放内核栈
+static void proc_dtor(void* obj)
+{
+    auto p = (Proc*)obj;
+    kfree_pages(p->kstack, 1);
+}
+
 // 初始化第一个内核进程
 void init_kproc()
 {
     // 初始化pid树
     rb_init(&pid_root);
 
+    // 创建进程结构体的对象缓存
+    proc_cache = kmem_cache_create("proc", sizeof(Proc), 8, proc_ctor, proc_dtor);
+
     // 初始化每个CPU的idle进程 (1-4)
     for (int i = 0; i < NCPU; i++) {
         auto p = create_proc();
@@ -66,6 +88,7 @@ void init_proc(Proc* p)
     init_sem(&p->childexit, 0);
     init_list_node(&p->children);
     init_list_node(&p->ptnode);
+    p->parent = NULL; // 对象可能被复用, 需清除旧的父进程
 
     // 初始化调度队列结点
     init_schinfo(&p->schinfo);
@@ -73,9 +96,13 @@ void init_proc(Proc* p)
     // 初始化进程页表为空
     init_pgdir(&p->pgdir);
 
+    // 静态分配的root_proc不经过proc_cache, 需要在此分配内核栈
+    if (p->kstack == NULL)
+        proc_ctor(p);
+
     // 栈从高地址向低地址增长
-    p->kcontext = kalloc_page() + PAGE_SIZE - sizeof(KernelContext);
-    p->ucontext = kalloc_page() + PAGE_SIZE - sizeof(UserContext);
+    p->kcontext = p->kstack + 2 * PAGE_SIZE - sizeof(KernelContext);
+    p->ucontext = p->kstack + PAGE_SIZE - sizeof(UserContext);
 
     // TODO: 因为trap_ret会将ucontext加载完, 所以直接将sp_el0设置为用户栈底
     p->ucontext->sp_el0 = round_up((u64)p->ucontext, PAGE_SIZE);
@@ -83,7 +110,7 @@ void init_proc(Proc* p)
 
 Proc* create_proc()
 {
-    Proc* p = kalloc(sizeof(Proc));
+    Proc* p = kmem_cache_alloc(proc_cache);
     init_proc(p);
 
     // 打印每个新进程的信息 (FOR DEBUG)
@@ -162,11 +189,8 @@ int wait(int* exitcode)
             // 如果子进程已经退出, 则释放子进程资源
             acquire_spinlock(&pp->lock); //*
             if (pp->state == ZOMBIE) {
-                // 从pid树中移除
                 int pid = pp->pid;
 
-                rb_erase_lock(&pp->_node, &pid_root);
-
                 // 保存退出状态
                 if (exitcode != 0)
                     *exitcode = pp->exitcode;
@@ -174,18 +198,18 @@ int wait(int* exitcode)
                 // 将子进程 从父进程的子进程链表中移除
                 _detach_from_list(&pp->ptnode);
 
-                // 递归释放页表页映射
-                free_pgdir(&pp->pgdir);
+                release_spinlock(&pp->lock); //*
+                release_spinlock(&p->lock);  //*
 
-                // 释放进程栈 (栈从高地址向低地址增长)
-                kfree_page((void*)round_down((u64)pp->kcontext - 1, PAGE_SIZE));
-                kfree_page((void*)round_down((u64)pp->ucontext - 1, PAGE_SIZE));
+                // 从pid树中移除 (锁顺序为 pid树锁 -> p->lock, 不能在持有进程锁时获取)
+                // 移除时会等待get_proc的持有者put_proc, 之后不会再有人访问pp
+                rb_erase_lock(&pp->_node, &pid_root);
 
-                // 释放进程结构体
-                release_spinlock(&pp->lock); //*
-                kfree(pp);
+                // 递归释放页表页映射
+                free_pgdir(&pp->pgdir);
 
-                release_spinlock(&p->lock); //*
+                // 释放进程结构体 (内核栈随对象保留在proc_cache中)
+                kmem_cache_free(proc_cache, pp);
                 return pid;
             }
             release_spinlock(&pp->lock); //*
@@ -264,6 +288,35 @@ NO_RETURN void exit(int code)
     PANIC();
 }
 
+// 从pid树中查找进程, pid为0时返回当前进程
+// 如果pid无效 (找不到进程) 则返回NULL
+// 找到其他进程时持有pid树锁返回, 防止进程在使用期间被wait回收, 用完后调用put_proc
+// 当前进程运行时不会被回收, 返回当前进程时不持有锁 (调用者可以让出CPU)
+// 锁顺序: pid树锁 -> p->lock -> rq锁
+Proc* get_proc(int pid)
+{
+    auto self = thisproc();
+    if (pid == 0 || pid == self->pid)
+        return self;
+
+    Proc pid_p = { .pid = pid };
+    acquire_spinlock(&pid_root.lock); //*
+    auto node_p = _rb_lookup(&pid_p._node, &pid_root, __pid_cmp);
+    if (node_p == NULL) {
+        release_spinlock(&pid_root.lock); //*
+        return NULL;
+    }
+
+    return container_of(node_p, Proc, _node);
+}
+
+// 释放get_proc返回的进程
+void put_proc(Proc* p)
+{
+    if (p != thisproc())
+        release_spinlock(&pid_root.lock); //*
+}
+
 // 遍历进程树, 终止进程
 // 设置进程的终止标志位, 并返回0
 // 如果pid无效 (找不到进程)  则返回-1
@@ -273,19 +326,17 @@ int kill(int pid)
     ASSERT(pid > NCPU + 1);
 
     // 从pid树中查找进程
-    Proc pid_p = { .pid = pid };
-    auto node_p = rb_lookup_lock(&pid_p._node, &pid_root, __pid_cmp);
-    if (node_p == NULL)
+    auto p = get_proc(pid);
+    if (p == NULL)
         return -1;
 
-    auto p = container_of(node_p, Proc, _node);
-
-    acquire_spinlock(&p->lock); //*
+    acquire_spinlock(&p->lock); //**
     p->killed = true;
-    release_spinlock(&p->lock); //*
+    release_spinlock(&p->lock); //**
 
     // 唤醒如果在睡眠的进程
     activate_proc(p);
 
+    put_proc(p);
     return 0;
 }
\ No newline at end of file
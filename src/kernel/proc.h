@@ -68,9 +68,34 @@ typedef struct KernelContext {
     u64 x30; // Procedure Link Register
 } KernelContext;
 
-//  进程的调度信息
+// 调度策略 (与Linux编号一致)
+#define SCHED_NORMAL 0 // 分时进程: 按vruntime公平调度
+#define SCHED_FIFO 1   // 实时进程: 无时间片, 只会被更高优先级的实时进程抢占
+#define SCHED_RR 2     // 实时进程: 同优先级之间按时间片轮转
+
+#define NICE_MIN -20    // 分时进程的最高静态优先级
+#define NICE_MAX 19     // 分时进程的最低静态优先级
+#define RT_PRIO_MAX 99  // 实时优先级范围 1~99, 数值越大越优先
+
+// 默认权重 (nice=0), 权重越大 虚拟运行时间增长越慢
+#define NICE_0_WEIGHT 1024
+
+//  进程的调度信息 (需持有进程锁)
 struct schinfo {
-    ListNode sched_node; // 串在调度队列中的结点
+    struct rb_node_ rq_node; // 串在调度红黑树中的结点 (仅RUNNABLE分时进程)
+    ListNode rt_node;        // 串在实时队列中的结点 (仅RUNNABLE实时进程)
+    int cpu;                 // 所在调度队列的CPU编号
+    int last_cpu;            // 上次运行所在的CPU编号
+    u64 affinity;            // 允许运行的CPU集合 (第i位对应CPU i)
+    u64 migrations;          // 在不同CPU之间迁移的次数
+    int policy;              // 调度策略
+    int nice;                // 分时进程的静态优先级
+    int rt_prio;             // 实时进程的优先级
+    u32 weight;              // 调度权重 (由nice决定)
+    u64 vruntime;            // 虚拟运行时间 (按权重缩放的时钟周期)
+    u64 exec_start;          // 本次开始运行的时间戳
+    u64 enqueue_time;        // 进入调度队列的时间戳 (统计等待延迟)
+    u64 timer_slack;         // 睡眠定时器允许延后的纳秒数, 用于合并定时中断
 };
 
 // 进程结构体
@@ -94,7 +119,7 @@ typedef struct Proc {
     struct schinfo schinfo; // 调度信息
     struct pgdir pgdir;     // 进程页表
 
-    void* kstack;            // 进程内核栈
+    void* kstack;            // 进程内核栈 (2页, 由proc_cache构造)
     UserContext* ucontext;   // 用户上下文 (进程栈sp)
     KernelContext* kcontext; // 内核上下文 (进程栈sp)
 } Proc;
@@ -106,3 +131,5 @@ int start_proc(Proc*, void (*entry)(u64), u64 arg);
 NO_RETURN void exit(int code);
 int wait(int* exitcode);
 int kill(int pid);
+Proc* get_proc(int pid);
+void put_proc(Proc* p);
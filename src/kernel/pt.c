@@ -14,8 +14,7 @@ PTEntriesPtr get_pte(struct pgdir* pgdir, u64 va, bool alloc)
     if (pgdir->pt == NULL) {
         if (alloc == false)
             return NULL;
-        pgdir->pt = (PTEntriesPtr)kalloc_page();
-        memset(pgdir->pt, 0, PAGE_SIZE);
+        pgdir->pt = (PTEntriesPtr)kalloc_page_zeroed();
     }
 
     auto pt = pgdir->pt;
@@ -30,11 +29,8 @@ PTEntriesPtr get_pte(struct pgdir* pgdir, u64 va, bool alloc)
         else {
             if (alloc == false)
                 return NULL;
-            // 给下一级页表分配一页内存
-            pt = (PTEntriesPtr)kalloc_page();
-
-            // 清空页表
-            memset(pt, 0, PAGE_SIZE);
+            // 给下一级页表分配一页已清零的内存
+            pt = (PTEntriesPtr)kalloc_page_zeroed();
 
             // 填充页表项, 指向新分配的下一级页表
             *pte = K2P(pt) | PTE_VALID | PTE_TABLE | PTE_USER | PTE_RW;
@@ -5,40 +5,339 @@
 #include <aarch64/intrinsic.h>
 #include <kernel/cpu.h>
 #include <common/rbtree.h>
+#include <driver/ipi.h>
+#include <driver/clock.h>
+#include <common/sem.h>
 
 extern bool panic_flag;
 
-// 调度队列 (需要持有锁)
-static Queue sched_queue; 
+#define SCHED_LATENCY_US 6000    // 调度周期: 每个可运行的分时进程在此时间内至少运行一次 (微秒)
+#define MIN_GRANULARITY_US 750   // 最小时间片, 限制进程很多时的切换开销 (微秒)
+#define WAKEUP_GRAN_US 1000      // 被唤醒的分时进程vruntime落后超过此值时抢占当前进程 (微秒)
+#define BALANCE_MS 100  // 负载均衡的周期 (毫秒)
+#define ALL_CPUS (BIT(NCPU) - 1)
+#define RR_SLICE_MS 100 // SCHED_RR实时进程的时间片 (毫秒)
+#define TIMER_SLACK_NS 50000 // 进程睡眠定时器的默认延后范围 (纳秒, 同Linux)
+
+// nice值 -> 调度权重, 相邻两级约相差1.25倍 (同Linux)
+static const u32 prio_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291, // -20 ~ -16
+    29154, 23254, 18705, 14949, 11916, // -15 ~ -11
+    9548, 7620, 6100, 4904, 3906,      // -10 ~ -6
+    3121, 2501, 1991, 1586, 1277,      // -5 ~ -1
+    1024, 820, 655, 526, 423,          // 0 ~ 4
+    335, 272, 215, 172, 137,           // 5 ~ 9
+    110, 87, 70, 56, 45,               // 10 ~ 14
+    36, 29, 23, 18, 15,                // 15 ~ 19
+};
+
+#define HIST_BUCKETS 32 // log2直方图的桶数: 第k个桶统计 [2^k, 2^(k+1)) 个时钟周期
+
+// 每个CPU的调度统计 (独占缓存行; 只在本CPU上更新, 不加锁, 允许轻微误差)
+typedef struct SchedStat {
+    u64 wakeups;     // 在本CPU上执行的唤醒次数 (activate_proc)
+    u64 picks;       // 从本CPU队列挑选到进程的次数
+    u64 steals;      // 从其他CPU窃取到进程的次数
+    u64 idle_picks;  // 没有可运行进程的次数
+    u64 voluntary;   // 主动切换 (睡眠或退出)
+    u64 involuntary; // 被动切换 (时间片用完, 被抢占, 或让出)
+    u64 migrations;  // 迁移到本CPU上运行的次数
+    u64 balanced;    // 负载均衡拉取的进程数
+    u64 rq_len_sum;  // 挑选时的本CPU队列长度之和 (用于求平均)
+    int rq_len_max;  // 挑选时的本CPU队列长度最大值
+    u64 wait_hist[HIST_BUCKETS];  // 等待延迟: 进入调度队列 -> 开始运行
+    u64 slice_hist[HIST_BUCKETS]; // 运行时长: 开始运行 -> 离开CPU
+} __attribute__((aligned(64))) SchedStat;
+
+static SchedStat sched_stats[NCPU];
+#define this_stat (&sched_stats[cpuid()])
+
+// 把时钟周期数计入log2直方图
+static void __hist_add(u64* hist, u64 ticks)
+{
+    int k = ticks == 0 ? 0 : 63 - __builtin_clzll(ticks);
+    if (k >= HIST_BUCKETS)
+        k = HIST_BUCKETS - 1;
+    hist[k]++;
+}
 
 // 调度定时器
 static struct timer sched_timer[NCPU];
-static void time_sched() { sched(RUNNABLE); }
+
+// 时间片用完: 只设置need_resched, 由中断返回前的check_resched切换
+// 不能在定时器处理函数中直接调用sched, 否则切换走时时间轮的处理循环仍在进行
+static void time_sched()
+{
+    auto p = thisproc();
+
+    // FIFO实时进程没有时间片, 只重新挂载定时器 (被降级或不再允许在本CPU运行后可恢复调度)
+    if (p->schinfo.policy == SCHED_FIFO && (p->schinfo.affinity & BIT(cpuid()))) {
+        set_cpu_timer(&sched_timer[cpuid()]);
+        return;
+    }
+
+    thiscpu->sched.need_resched = true;
+}
 
 // 进程上下文切换
 extern void swtch(KernelContext** old_ctx, KernelContext* new_ctx);
 
+// 微秒 -> 时钟周期
+static u64 __us_to_tick(u64 us) { return us * get_clock_frequency() / 1000000; }
+
+// 进程的调度等级: idle为-1, 分时进程为0, 实时进程为其优先级
+static int __rank(Proc* p)
+{
+    if (p->idle)
+        return -1;
+    if (p->schinfo.policy == SCHED_NORMAL)
+        return 0;
+    return p->schinfo.rt_prio;
+}
+
+// 被唤醒的进程p是否应当抢占正在运行的cur (不持有cur的锁读取, 仅作估计)
+// 优先级不同时高者抢占; 同为分时进程时, p的vruntime落后cur超过唤醒粒度才抢占, 避免频繁切换
+static bool __preempts(Proc* p, Proc* cur)
+{
+    if (__rank(p) != __rank(cur))
+        return __rank(p) > __rank(cur);
+    if (__rank(p) != 0)
+        return false;
+
+    u64 cur_vr = cur->schinfo.vruntime;
+    u64 now = get_timestamp();
+    if (now > cur->schinfo.exec_start)
+        cur_vr += (now - cur->schinfo.exec_start) * NICE_0_WEIGHT / cur->schinfo.weight;
+
+    return p->schinfo.vruntime + __us_to_tick(WAKEUP_GRAN_US) < cur_vr;
+}
+
+// 调度队列中最高的实时优先级, 没有实时进程则返回0
+static int __rt_top(struct sched* sched)
+{
+    if (sched->rt_bitmap[1])
+        return 127 - __builtin_clzll(sched->rt_bitmap[1]);
+    if (sched->rt_bitmap[0])
+        return 63 - __builtin_clzll(sched->rt_bitmap[0]);
+    return 0;
+}
+
+// 调度队列是否为空 (可不持有锁读取, 仅作提示)
+static bool __rq_empty(struct sched* sched)
+{
+    return sched->rq.rb_node == NULL && sched->rt_bitmap[0] == 0 && sched->rt_bitmap[1] == 0;
+}
+
+// IPI_RESCHED: 把CPU从WFI中唤醒, 或让被唤醒的进程抢占当前进程
+// 唤醒方已设置need_resched, 切换推迟到中断返回前的check_resched
+static void resched_handler()
+{
+    auto p = thisproc();
+
+    if (!p->idle && __rt_top(&thiscpu->sched) > __rank(p))
+        thiscpu->sched.need_resched = true;
+}
+
 // 初始化调度器
 void init_sched()
 {
-    queue_init(&sched_queue); // 初始化调度队列
+    // 初始化每个CPU的调度队列和调度定时器
+    set_ipi_handler(IPI_RESCHED, resched_handler);
 
-    // 初始化调度定时器
     for (int i = 0; i < NCPU; i++) {
-        sched_timer[i].elapse = 20; // 间隔时间
+        rb_init(&cpus[i].sched.rq);
+        cpus[i].sched.min_vruntime = 0;
+        cpus[i].sched.idling = false;
+        cpus[i].sched.need_resched = false;
+        cpus[i].sched.rt_bitmap[0] = cpus[i].sched.rt_bitmap[1] = 0;
+        cpus[i].sched.nr_running = 0;
+        for (int k = 0; k < NCPU; k++)
+            cpus[i].sched.nr_allowed[k] = 0;
+        for (int k = 0; k <= RT_PRIO_MAX; k++)
+            init_list_node(&cpus[i].sched.rt_queue[k]);
+        cpus[i].sched.load = 0;
+        sched_timer[i].elapse_tick = 0; // 每次切换时按时间片设置
         sched_timer[i].handler = time_sched;
     }
 }
 
 // 为每个新进程 初始化自定义的schinfo
-void init_schinfo(struct schinfo* info) { init_list_node(&info->sched_node); }
+void init_schinfo(struct schinfo* info)
+{
+    info->cpu = -1;
+    info->last_cpu = -1;
+    info->affinity = ALL_CPUS;
+    info->migrations = 0;
+    info->policy = SCHED_NORMAL;
+    info->nice = 0;
+    info->rt_prio = 0;
+    info->weight = NICE_0_WEIGHT;
+    info->vruntime = 0;
+    info->exec_start = 0;
+    info->timer_slack = TIMER_SLACK_NS;
+}
 
 // 返回当前CPU上执行的进程
 Proc* thisproc() { return thiscpu->sched.proc; }
 
+// 调度红黑树比较函数: 按vruntime排序, 相等时比较地址
+static bool __rq_cmp(rb_node lnode, rb_node rnode)
+{
+    auto l = container_of(lnode, struct schinfo, rq_node);
+    auto r = container_of(rnode, struct schinfo, rq_node);
+
+    if (l->vruntime != r->vruntime)
+        return l->vruntime < r->vruntime;
+    return lnode < rnode;
+}
+
+// 将进程加入第cpu个CPU的调度队列 (需持有进程锁)
+// 实时进程加入其优先级链表的尾部, 分时进程按vruntime插入红黑树
+static void __enqueue(Proc* p, int cpu)
+{
+    auto sched = &cpus[cpu].sched;
+    p->schinfo.cpu = cpu;
+
+    ASSERT(p->schinfo.affinity & BIT(cpu));
+    p->schinfo.enqueue_time = get_timestamp();
+
+    acquire_spinlock(&sched->rq.lock); //**
+
+    sched->nr_running++;
+    for (int i = 0; i < NCPU; i++)
+        if (p->schinfo.affinity & BIT(i))
+            sched->nr_allowed[i]++;
+    if (p->schinfo.policy == SCHED_NORMAL)
+        sched->load += p->schinfo.weight;
+
+    if (p->schinfo.policy != SCHED_NORMAL) {
+        int prio = p->schinfo.rt_prio;
+        _insert_into_list(sched->rt_queue[prio].prev, &p->schinfo.rt_node);
+        sched->rt_bitmap[prio / 64] |= BIT(prio % 64);
+    } else {
+        // 睡眠过的进程不能凭积攒的vruntime长期独占CPU
+        if (p->schinfo.vruntime < sched->min_vruntime)
+            p->schinfo.vruntime = sched->min_vruntime;
+
+        ASSERT(0 == _rb_insert(&p->schinfo.rq_node, &sched->rq, __rq_cmp));
+    }
+
+    release_spinlock(&sched->rq.lock); //**
+}
+
+// 将进程从第cpu个CPU的调度队列中移除 (需持有树锁)
+static void __dequeue(Proc* p, int cpu)
+{
+    auto sched = &cpus[cpu].sched;
+
+    sched->nr_running--;
+    for (int i = 0; i < NCPU; i++)
+        if (p->schinfo.affinity & BIT(i))
+            sched->nr_allowed[i]--;
+    if (p->schinfo.policy == SCHED_NORMAL)
+        sched->load -= p->schinfo.weight;
+
+    if (p->schinfo.policy != SCHED_NORMAL) {
+        int prio = p->schinfo.rt_prio;
+        _detach_from_list(&p->schinfo.rt_node);
+        if (_empty_list(&sched->rt_queue[prio]))
+            sched->rt_bitmap[prio / 64] &= ~BIT(prio % 64);
+    } else
+        _rb_erase(&p->schinfo.rq_node, &sched->rq);
+}
+
+// 为被唤醒的进程p选择调度队列 (只在p的affinity允许的CPU中选择)
+static int __select_cpu(Proc* p)
+{
+    u64 allowed = p->schinfo.affinity;
+    int local = cpuid();
+    int prev = p->schinfo.last_cpu;
+    int rank = __rank(p);
+
+    // 上次运行的CPU空闲时, 放回原处 (缓存仍是热的)
+    if (prev >= 0 && (allowed & BIT(prev)) && cpus[prev].sched.proc->idle)
+        return prev;
+
+    // 本CPU空闲时, 直接放在本CPU
+    if ((allowed & BIT(local)) && thisproc()->idle)
+        return local;
+
+    // 其次选择正在WFI中睡眠的CPU
+    for (int i = 0; i < NCPU; i++) {
+        int c = (local + i) % NCPU;
+        if ((allowed & BIT(c)) && cpus[c].sched.idling)
+            return c;
+    }
+
+    // 实时进程选择运行着更低优先级进程的CPU, 以便立即抢占
+    for (int i = 0; rank > 0 && i < NCPU; i++) {
+        int c = (local + i) % NCPU;
+        if ((allowed & BIT(c)) && __rank(cpus[c].sched.proc) < rank)
+            return c;
+    }
+
+    // 都在忙: 在上次运行的CPU(缓存) 和 本CPU(与唤醒者共享数据) 中选择排队进程较少的一个
+    int best = -1;
+    if (prev >= 0 && (allowed & BIT(prev)))
+        best = prev;
+    if ((allowed & BIT(local))
+        && (best < 0 || cpus[local].sched.nr_running < cpus[best].sched.nr_running))
+        best = local;
+    if (best < 0)
+        best = __builtin_ctzll(allowed);
+
+    return best;
+}
+
+// 第cpu个CPU的调度队列新增了进程p
+// 如果该CPU在WFI中睡眠, 或p应当抢占它正在运行的进程, 则用IPI通知它
+// 如果它正忙, 则唤醒一个空闲CPU来窃取
+static void __kick(int cpu, Proc* p)
+{
+    // 与idle_wait中的 设置idling->检查队列 配对, 保证不会丢失唤醒
+    arch_fence();
+
+    if (cpus[cpu].sched.idling) {
+        send_ipi(BIT(cpu), IPI_RESCHED);
+        return;
+    }
+
+    // 应当抢占目标CPU上的进程: 设置标志, 其他CPU由IPI触发
+    // 本CPU在唤醒方释放锁后的cond_resched中切换, 在中断中唤醒则在中断返回时切换
+    if (__preempts(p, cpus[cpu].sched.proc)) {
+        cpus[cpu].sched.need_resched = true;
+        bool trap = _arch_disable_trap(); //*
+        if (cpu != (int)cpuid())
+            send_ipi(BIT(cpu), IPI_RESCHED);
+        if (trap)
+            _arch_enable_trap(); //*
+        return;
+    }
+
+    if (cpus[cpu].sched.proc->idle)
+        return;
+
+    for (int i = 1; i < NCPU; i++) {
+        int c = (cpu + i) % NCPU;
+        if (cpus[c].sched.idling) {
+            send_ipi(BIT(c), IPI_RESCHED);
+            return;
+        }
+    }
+}
+
+// 累计当前进程的运行时间到vruntime (需持有进程锁)
+static void __update_vruntime(Proc* p)
+{
+    u64 now = get_timestamp();
+    u64 delta = now - p->schinfo.exec_start;
+    p->schinfo.vruntime += delta * NICE_0_WEIGHT / p->schinfo.weight;
+    p->schinfo.exec_start = now;
+}
+
 // 唤醒进程
 // 如果进程状态是 RUNNING/RUNNABLE: 什么都不做
-// 如果进程状态是 SLEEPING/UNUSED:  将进程状态设置为 RUNNABLE 并将其添加到调度队列
+// 如果进程状态是 SLEEPING/UNUSED:  将进程状态设置为 RUNNABLE 并将其添加到当前CPU的调度队列
 bool activate_proc(Proc* p)
 {
     acquire_spinlock(&p->lock); //*
@@ -57,10 +356,17 @@ bool activate_proc(Proc* p)
         // 更新进程状态设置为 RUNNABLE
         p->state = RUNNABLE;
 
-        // 将其添加到调度队列
-        queue_push_lock(&sched_queue, &p->schinfo.sched_node); //**
+        // 将其添加到选定CPU的调度队列, 并唤醒可能在睡眠的CPU
+        // 中断未关闭时cpuid()可能随即改变, 但加入任一CPU的队列都是正确的
+        int cpu = __select_cpu(p);
+        __enqueue(p, cpu); //**
+        __kick(cpu, p);
+        this_stat->wakeups++;
 
         release_spinlock(&p->lock); //*
+
+        // 被唤醒的进程应当抢占本CPU时, 在进程上下文中立即让出
+        cond_resched();
         return true;
     }
 
@@ -75,136 +381,600 @@ static void update_this_state(enum procstate new_state)
     auto p = thisproc();
     p->state = new_state;
 
-    // 如果new_state=SLEEPING/ZOMBIE, 则从调度队列中移除
-    if (new_state == SLEEPING || new_state == ZOMBIE)
-        queue_detach_lock(&sched_queue, &p->schinfo.sched_node); //**
+    // 运行中的进程不在调度队列中, 先结算其运行时间
+    __hist_add(this_stat->slice_hist, get_timestamp() - p->schinfo.exec_start);
+    __update_vruntime(p);
+
+    if (new_state == RUNNABLE)
+        this_stat->involuntary++;
+    else
+        this_stat->voluntary++;
+
+    // 如果new_state=RUNNABLE, 则放回本CPU的调度队列 (不再允许在本CPU运行时, 另选一个CPU)
+    // 此时本CPU还有其他进程要运行, 唤醒一个空闲CPU来窃取
+    if (new_state == RUNNABLE) {
+        int cpu = cpuid();
+        if (!(p->schinfo.affinity & BIT(cpu)))
+            cpu = __select_cpu(p);
+        __enqueue(p, cpu); //**
+        __kick(cpu, p);
+    }
+}
+
+// 从第cpu个CPU的调度队列中取出调度等级不低于min_rank, 且允许在dest上运行的最优进程
+// (需持有树锁, 成功时获取进程锁)
+// 实时进程优先: 按优先级从高到低, 同优先级先进先出; 其次是vruntime最小的分时进程
+// 抢不到进程锁也没关系 (避免与树锁发生死锁), 只有进程正在切换出CPU时才会抢不到
+// 尝试锁定排队中的进程p, 作为dest上的下一个进程 (获取锁)
+// 先不加锁检查亲和性以跳过不能运行的进程; set_affinity持有进程锁修改亲和性, 加锁后须再次确认
+static bool __try_take(Proc* p, int dest)
+{
+    if (!(p->schinfo.affinity & BIT(dest)) || !try_acquire_spinlock(&p->lock))
+        return false;
+
+    if (!(p->schinfo.affinity & BIT(dest))) {
+        release_spinlock(&p->lock);
+        return false;
+    }
+    return true;
 }
 
-// 从调度队列中挑选进程 (获取锁)
-static Proc* pick_next()
+static Proc* __pick_from(int cpu, int min_rank, int dest)
 {
-    // 如果调度队列中没有进程, 则返回idle
-    if (queue_empty(&sched_queue))
-        return thiscpu->sched.idle_proc;
+    auto sched = &cpus[cpu].sched;
+
+    for (int w = 1; w >= 0; w--) {
+        for (u64 bits = sched->rt_bitmap[w]; bits != 0;) {
+            int prio = w * 64 + 63 - __builtin_clzll(bits);
+            bits &= ~BIT(prio % 64);
+            if (prio < min_rank)
+                return NULL;
+
+            auto head = &sched->rt_queue[prio];
+            for (auto node = head->next; node != head; node = node->next) {
+                auto p = container_of(node, Proc, schinfo.rt_node);
+                if (__try_take(p, dest)) { //**
+                    ASSERT(p->state == RUNNABLE);
+                    __dequeue(p, cpu);
+                    return p;
+                }
+            }
+        }
+    }
 
-    queue_lock(&sched_queue); //* 调度队列锁
+    if (min_rank > 0)
+        return NULL;
 
-    // 遍历调度队列, 选择第一个可运行进程
-    for (ListNode* node = queue_front(&sched_queue);;) {
-        auto p = container_of(node, Proc, schinfo.sched_node);
-        auto node_next = node->next;
+    for (auto node = _rb_first(&sched->rq); node != NULL; node = _rb_next(node)) {
+        auto p = container_of(node, Proc, schinfo.rq_node);
 
-        // 尝试去抢锁, 抢不到也没关系 (避免与队列锁发生死锁)
-        if (p != thisproc() && p->state == RUNNABLE
-            && try_acquire_spinlock(&p->lock)) { //**
+        if (__try_take(p, dest)) { //**
+            // 树中只有RUNNABLE进程
+            ASSERT(p->state == RUNNABLE);
+            __dequeue(p, cpu);
 
-            // 再次判断状态, 避免抢锁时被其他CPU修改
-            if (p->state == RUNNABLE) {
-                // 将该进程 移动到 队列尾
-                _queue_detach(&sched_queue, node);
-                _queue_push(&sched_queue, node);
-                queue_unlock(&sched_queue); //*
-                return p;
-            }
+            if (p->schinfo.vruntime > sched->min_vruntime)
+                sched->min_vruntime = p->schinfo.vruntime;
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+// 从第cpu个CPU的调度队列中窃取一个调度等级不低于min_rank的进程到本CPU (获取锁)
+static Proc* __steal_from(int cpu, int min_rank)
+{
+    auto rq = &cpus[cpu].sched.rq;
+
+    // 队列中没有允许在本CPU上运行的进程, 或队列正被占用时跳过, 不在他人的队列锁上自旋
+    if (cpus[cpu].sched.nr_allowed[cpuid()] == 0 || !try_acquire_spinlock(&rq->lock)) //* 远端树锁
+        return NULL;
+
+    auto p = __pick_from(cpu, min_rank, cpuid()); //** next进程锁
+    u64 remote_min = cpus[cpu].sched.min_vruntime;
+
+    release_spinlock(&rq->lock); //* 远端树锁
+
+    if (p != NULL) {
+        // 迁移到本CPU: 保持其相对于所在队列min_vruntime的偏移
+        u64 lag = p->schinfo.vruntime > remote_min ? p->schinfo.vruntime - remote_min : 0;
+        p->schinfo.vruntime = thiscpu->sched.min_vruntime + lag;
+        p->schinfo.cpu = cpuid();
+    }
+
+    return p;
+}
+
+// 从其他CPU的调度队列中窃取一个调度等级不低于min_rank的进程 (获取锁)
+static Proc* __steal(int min_rank)
+{
+    for (int i = 1; i < NCPU; i++) {
+        auto p = __steal_from((cpuid() + i) % NCPU, min_rank); //** next进程锁
+        if (p != NULL)
+            return p;
+    }
+
+    return NULL;
+}
+
+// 负载均衡 (定时器处理函数, CPU非空闲时每BALANCE_MS毫秒运行一次, 空闲睡眠期间停止)
+// 从排队进程最多的CPU拉取一个进程到本CPU, 两者相差至少2个时才迁移, 避免来回搬运
+// 在中断中获取树锁是安全的: 自旋锁在等待和持有期间关闭中断, 本CPU上不会有被打断的持锁者
+static void load_balance(struct timer* t)
+{
+    int local = cpuid();
+    int busiest = -1;
+    int max = cpus[local].sched.nr_running + 1;
+
+    for (int i = 1; i < NCPU; i++) {
+        int c = (local + i) % NCPU;
+        if (cpus[c].sched.nr_running > max) {
+            busiest = c;
+            max = cpus[c].sched.nr_running;
+        }
+    }
 
-            release_spinlock(&p->lock); //**
+    if (busiest >= 0) {
+        auto p = __steal_from(busiest, 0); //* 进程锁
+        if (p != NULL) {
+            __enqueue(p, local); //**
+            this_stat->balanced++;
+            release_spinlock(&p->lock); //*
         }
+    }
+
+    set_cpu_timer(t);
+}
+
+static struct timer balance_timer[NCPU];
+
+// 在当前CPU上启动周期性负载均衡 (idle_entry调用, 之后由idle_wait在睡眠前后停止和恢复)
+void init_sched_percpu()
+{
+    auto t = &balance_timer[cpuid()];
+    t->elapse = BALANCE_MS;
+    t->slack_tick = BALANCE_MS * get_clock_frequency() / 1000 / 10; // 负载均衡不需要准时
+    t->handler = load_balance;
+    set_cpu_timer(t);
+}
 
-        // 继续遍历下一个进程, 直到队首退出
-        if (node_next != queue_front(&sched_queue))
-            node = node_next;
-        else
-            break;
+// 从本CPU的调度队列中挑选调度等级不低于min_rank的最优进程, 没有则窃取 (获取锁)
+// 如果没有可运行进程, 则返回NULL
+static Proc* pick_next(int min_rank)
+{
+    auto sched = &thiscpu->sched;
+    auto stat = this_stat;
+
+    // 采样本CPU的队列长度
+    stat->rq_len_sum += sched->nr_running;
+    if (sched->nr_running > stat->rq_len_max)
+        stat->rq_len_max = sched->nr_running;
+
+    if (!__rq_empty(sched)) {
+        acquire_spinlock(&sched->rq.lock); //* 树锁
+
+        auto p = __pick_from(cpuid(), min_rank, cpuid()); //** next进程锁
+        release_spinlock(&sched->rq.lock); //* 树锁
+
+        if (p != NULL) {
+            stat->picks++;
+            return p;
+        }
     }
 
-    queue_unlock(&sched_queue); //* 调度队列锁
+    // 本CPU没有可运行进程, 则从其他CPU窃取
+    auto p = __steal(min_rank);
+    if (p != NULL)
+        stat->steals++;
+    else
+        stat->idle_picks++;
+    return p;
+}
+
+// 进程在本CPU上的时间片长度 (时钟周期)
+// 分时进程按权重瓜分调度周期, 周期为SCHED_LATENCY_US, 排队进程过多时按最小时间片延长
+static u64 __slice_tick(Proc* p)
+{
+    if (p->schinfo.policy == SCHED_RR)
+        return __us_to_tick(RR_SLICE_MS * 1000);
+
+    // 不持有树锁读取, 仅作估计
+    auto sched = &thiscpu->sched;
+    u64 nr = sched->nr_running + 1;
+    u64 period = SCHED_LATENCY_US;
+    if (period < nr * MIN_GRANULARITY_US)
+        period = nr * MIN_GRANULARITY_US;
+
+    u64 w = p->schinfo.weight;
+    u64 slice = period * w / (sched->load + w);
+    if (slice < MIN_GRANULARITY_US)
+        slice = MIN_GRANULARITY_US;
+
+    return __us_to_tick(slice);
+}
+
+// 中断/异常返回前检查need_resched标志, 需要时让出CPU
+// 只在安全点切换: 本CPU不持有任何自旋锁 (被打断的代码若持有树锁, sched会在pick_next中自锁)
+void check_resched()
+{
+    auto p = thisproc();
+
+    if (!thiscpu->sched.need_resched || p->idle)
+        return;
 
-    // 如果没有可运行进程, 则返回idle
-    return thiscpu->sched.idle_proc;
+    // 持锁期间中断关闭, 正常不会在此打断; 保留检查以防在持锁时发生同步异常
+    if (thiscpu->lock_depth != 0)
+        return;
+
+    acquire_sched();
+    sched(RUNNABLE);
+    release_sched();
+}
+
+// 唤醒路径释放最后一把锁后调用, 在进程上下文中立即处理本CPU上的抢占, 不必等到下一次中断
+// 只在中断开启且不持有自旋锁时切换; 中断处理函数中中断关闭, 留给中断返回前的check_resched
+void cond_resched()
+{
+    bool trap = _arch_disable_trap(); //*
+    if (!trap)
+        return;
+
+    bool need = thiscpu->sched.need_resched && thiscpu->lock_depth == 0;
+    _arch_enable_trap(); //*
+
+    if (need)
+        check_resched();
 }
 
 // 移除可能存在的调度定时器
 void acquire_sched() { cancel_cpu_timer(&sched_timer[cpuid()]); }
 void release_sched() { }
 
+// swtch返回后 释放切换前持有的锁 (idle进程不持有自己的锁)
+// 切换方持有 自己的进程锁 和 在pick_next中获取的 新进程锁
+static void __switch_finish()
+{
+    auto before = thiscpu->sched.before_proc;
+    auto this = thisproc();
+
+    if (!before->idle)
+        release_spinlock(&before->lock); //* before进程锁
+    if (!this->idle)
+        release_spinlock(&this->lock); //** next进程锁
+}
+
 // 接受调度 并将当前进程状态更新为new_state (需持有sched_lock)
+// 直接从当前进程切换到下一个进程, 只有无进程可运行时才切换到idle进程
 void sched(enum procstate new_state)
 {
     // 获取当前执行的进程
     Proc* this = thisproc();
-    Proc* before;
     Proc* next;
 
-    // 如果非idle进程, 则切换到 idle进程
+    // 调用者不能持有任何自旋锁, 否则切换后会在其他进程中被释放
+    ASSERT(thiscpu->lock_depth == 0);
+
     if (this->idle == false) {
-        // 该锁在idle进程的 swtch结束后释放
+        // 该锁在下一个进程的 swtch结束后释放
         acquire_spinlock(&this->lock); //* before进程锁
 
         // 如果有终止标记, 且新状态不为ZOMBIE, 则调度器直接返回
-        if (this->killed && new_state != ZOMBIE)
+        if (this->killed && new_state != ZOMBIE) {
+            release_spinlock(&this->lock); //*
             return;
+        }
 
         // 确保当前进程是 RUNNING 状态
         ASSERT(this->state == RUNNING);
+    }
 
-        // 更新当前进程状态为 new_state
-        update_this_state(new_state);
+    thiscpu->sched.need_resched = false;
+
+    // 选择下一个进程 (获取锁)
+    // 实时进程让出CPU时, 只让给不低于自己优先级的进程
+    int min_rank = 0;
+    if (this->idle == false && new_state == RUNNABLE)
+        min_rank = __rank(this);
+    next = pick_next(min_rank); //** next进程锁
+
+    if (next == NULL) {
+        // 如果是idle进程, 则退出执行wfi
+        if (this->idle)
+            return;
+
+        // 没有其他可运行进程, 当前进程让出CPU时直接继续运行
+        if (new_state == RUNNABLE && (this->schinfo.affinity & BIT(cpuid()))) {
+            __update_vruntime(this);
+            sched_timer[cpuid()].elapse_tick = __slice_tick(this);
+            set_cpu_timer(&sched_timer[cpuid()]);
+            release_spinlock(&this->lock); //*
+            return;
+        }
 
-        // 将CPU切换到idle进程
+        // 当前进程睡眠或退出, 则切换到idle进程
         next = thiscpu->sched.idle_proc;
-        thiscpu->sched.proc = next;
+    }
+
+    // 更新当前进程状态为 new_state
+    if (this->idle == false)
+        update_this_state(new_state);
+
+    if (next->idle == false) {
+        ASSERT(next->state == RUNNABLE);
+        next->state = RUNNING;
+        next->schinfo.exec_start = get_timestamp();
+        __hist_add(this_stat->wait_hist, next->schinfo.exec_start - next->schinfo.enqueue_time);
+
+        // 统计跨CPU迁移
+        if (next->schinfo.last_cpu != (int)cpuid()) {
+            if (next->schinfo.last_cpu >= 0) {
+                next->schinfo.migrations++;
+                this_stat->migrations++;
+            }
+            next->schinfo.last_cpu = cpuid();
+        }
 
-        // 记录当前进程, 用于释放锁
-        thiscpu->sched.before_proc = this;
+        // 启用调度定时器
+        sched_timer[cpuid()].elapse_tick = __slice_tick(next);
+        set_cpu_timer(&sched_timer[cpuid()]);
+    }
+
+    thiscpu->sched.proc = next;
 
-        // 加载idle进程的空页表
+    // 记录当前进程, 用于释放锁
+    thiscpu->sched.before_proc = this;
+
+    // 加载进程页表 (TTBR0已指向该页表时, 省去写寄存器和刷新TLB)
+    extern PTEntries invalid_pt;
+    u64 ttbr0 = next->pgdir.pt ? K2P(next->pgdir.pt) : K2P(&invalid_pt);
+    if (arch_get_ttbr0() != ttbr0)
         attach_pgdir(&next->pgdir);
 
-        //~ before进程上下文 -> idle进程上下文
-        swtch(&this->kcontext, next->kcontext);
+    // 持有的锁由切换后的进程释放, 释放后应恢复的中断状态属于各自进程, 跨切换保存
+    bool lock_trap = thiscpu->lock_trap;
 
-        // idle进程执行完毕, 返回到当前进程 (持有锁)
-        release_spinlock(&this->lock); //** next进程锁
+    //~ 当前进程上下文 -> next进程上下文
+    swtch(&this->kcontext, next->kcontext);
+
+    // 被切换回来 (可能已在其他CPU上)
+    thiscpu->lock_trap = lock_trap;
+    __switch_finish();
+}
+
+// 空闲CPU在WFI中睡眠, 直到有中断到来 (定时器, 或__kick发来的IPI)
+// 不再有周期性时钟中断, 睡眠期间不占用宿主机CPU
+// 睡眠前停止负载均衡定时器: 有工作到来时__kick会唤醒本CPU, 醒来后再恢复
+void idle_wait()
+{
+    auto sched = &thiscpu->sched;
+
+    // 关闭中断后再检查, WFI在中断挂起时仍会醒来
+    bool trap = _arch_disable_trap(); //*
+
+    sched->idling = true;
+    arch_fence(); // 与__kick中的 入队->检查idling 配对
+
+    // 任一调度队列中有允许在本CPU上运行的进程, 都说明还有进程可以窃取, 不能睡眠
+    // 只绑定在其他CPU上的排队进程与本CPU无关
+    bool empty = true;
+    for (int i = 0; i < NCPU; i++)
+        if (cpus[i].sched.nr_allowed[cpuid()] > 0)
+            empty = false;
+
+    if (empty && !panic_flag) {
+        cancel_cpu_timer(&balance_timer[cpuid()]);
+        arch_wfi();
+    }
+
+    sched->idling = false;
+
+    // 醒来后可能有进程要运行, 恢复负载均衡; 再次睡眠前会重新停止
+    auto t = &balance_timer[cpuid()];
+    if (!t->_armed)
+        set_cpu_timer(t);
+
+    // 开启中断, 处理唤醒本CPU的中断
+    if (trap)
+        _arch_enable_trap(); //*
+}
+
+// 设置进程p的nice值 (超出范围时截断)
+void set_nice(Proc* p, int nice)
+{
+    if (nice < NICE_MIN)
+        nice = NICE_MIN;
+    if (nice > NICE_MAX)
+        nice = NICE_MAX;
+
+    // 权重只影响vruntime的增长速度, 不改变在红黑树中的位置, 但要更新所在队列的总权重
+    acquire_spinlock(&p->lock); //*
+
+    u32 weight = prio_to_weight[nice - NICE_MIN];
+    if (p->state == RUNNABLE && p->schinfo.policy == SCHED_NORMAL) {
+        auto sched = &cpus[p->schinfo.cpu].sched;
+        acquire_spinlock(&sched->rq.lock); //**
+        sched->load += weight;
+        sched->load -= p->schinfo.weight;
+        release_spinlock(&sched->rq.lock); //**
     }
 
-    // 如果是idle进程, 则切换到 调度队列首进程
-    else {
-        for (;;) {
-            // 选择下一个进程 (获取锁)
-            next = pick_next(); //** next进程锁
+    p->schinfo.nice = nice;
+    p->schinfo.weight = weight;
 
-            // 如果还是idle进程, 则退出执行wfi
-            if (next == this)
-                return;
+    release_spinlock(&p->lock); //*
+}
 
-            // 切换到下一个进程
-            ASSERT(next->state == RUNNABLE);
-            next->state = RUNNING;
-            thiscpu->sched.proc = next;
+int get_nice(Proc* p) { return p->schinfo.nice; }
 
-            // 加载进程页表
-            attach_pgdir(&next->pgdir);
+// 设置进程p的调度策略和实时优先级, 参数无效时返回-1
+// SCHED_NORMAL的优先级必须为0, SCHED_FIFO/SCHED_RR的优先级为1~RT_PRIO_MAX
+int set_scheduler(Proc* p, int policy, int prio)
+{
+    if (policy == SCHED_NORMAL) {
+        if (prio != 0)
+            return -1;
+    } else if (policy == SCHED_FIFO || policy == SCHED_RR) {
+        if (prio < 1 || prio > RT_PRIO_MAX)
+            return -1;
+    } else
+        return -1;
 
-            // 启用调度定时器
-            set_cpu_timer(&sched_timer[cpuid()]);
+    acquire_spinlock(&p->lock); //*
+
+    // 持有进程锁时, RUNNABLE进程一定在所在CPU的调度队列中, 需要换到新的队列
+    bool queued = (p->state == RUNNABLE);
+    int cpu = p->schinfo.cpu;
+    if (queued) {
+        acquire_spinlock(&cpus[cpu].sched.rq.lock); //**
+        __dequeue(p, cpu);
+        release_spinlock(&cpus[cpu].sched.rq.lock); //**
+    }
+
+    p->schinfo.policy = policy;
+    p->schinfo.rt_prio = prio;
+
+    if (queued) {
+        __enqueue(p, cpu); //**
+        __kick(cpu, p);
+    }
+
+    release_spinlock(&p->lock); //*
+
+    // 修改自己的调度策略后立即重新调度, 使新的策略生效
+    if (p == thisproc())
+        yield();
+
+    return 0;
+}
+
+int get_scheduler(Proc* p) { return p->schinfo.policy; }
+
+// 设置进程p允许运行的CPU集合, 集合为空时返回-1
+int set_affinity(Proc* p, u64 mask)
+{
+    mask &= ALL_CPUS;
+    if (mask == 0)
+        return -1;
+
+    acquire_spinlock(&p->lock); //*
+
+    // 排队中的进程先出队再修改, 保持队列的nr_allowed计数一致
+    int cpu = p->schinfo.cpu;
+    bool queued = (p->state == RUNNABLE);
+    if (queued) {
+        acquire_spinlock(&cpus[cpu].sched.rq.lock); //**
+        __dequeue(p, cpu);
+        release_spinlock(&cpus[cpu].sched.rq.lock); //**
+    }
 
-            //~ idle进程上下文 -> next进程上下文
-            swtch(&this->kcontext, next->kcontext);
+    p->schinfo.affinity = mask;
 
-            // 进程执行完毕, 返回到idle进程 (持有锁)
-            before = thiscpu->sched.before_proc;
+    // 重新入队, 已不允许在原CPU上运行则换到允许的CPU上
+    if (queued) {
+        if (!(mask & BIT(cpu)))
+            cpu = __select_cpu(p);
+        __enqueue(p, cpu); //**
+        __kick(cpu, p);
+    }
+
+    release_spinlock(&p->lock); //*
+
+    // 自己不再允许在当前CPU上运行, 则立即让出 (正在其他CPU上运行的进程在下次调度时迁移)
+    if (p == thisproc() && !(mask & BIT(cpuid())))
+        yield();
+
+    return 0;
+}
+
+u64 get_affinity(Proc* p) { return p->schinfo.affinity; }
+
+// 睡眠ns纳秒, 返回剩余的纳秒数
+// 在不会被post的信号量上超时等待, 被提前唤醒 (例如被kill) 时返回值非0
+u64 sleep_ns(u64 ns)
+{
+    if (ns == 0)
+        return 0;
+    if (ns > SLEEP_MAX_NS)
+        ns = SLEEP_MAX_NS;
+
+    Semaphore sem;
+    init_sem(&sem, 0);
+
+    u64 expires = get_timestamp() + ns_to_ticks(ns);
+    wait_sem_timeout(&sem, ns);
+
+    u64 now = get_timestamp();
+    if (now >= expires)
+        return 0;
+    return ticks_to_ns(expires - now);
+}
+
+// 睡眠ms毫秒, 返回剩余的毫秒数 (向上取整)
+u64 sleep_ms(u64 ms)
+{
+    if (ms > SLEEP_MAX_NS / 1000000)
+        ms = SLEEP_MAX_NS / 1000000;
+    u64 left = sleep_ns(ms * 1000000);
+    return (left + 999999) / 1000000;
+}
+
+// 打印log2直方图的非空桶
+static void __hist_print(const char* name, u64* hist)
+{
+    printk("sched: %s (cycles):\n", name);
+    for (int k = 0; k < HIST_BUCKETS; k++)
+        if (hist[k] != 0)
+            printk("  [2^%d, 2^%d): %llu\n", k, k + 1, hist[k]);
+}
+
+// 打印调度统计: 每个CPU的计数器, 以及所有CPU合计的延迟直方图
+void sched_stat()
+{
+    static u64 wait_hist[HIST_BUCKETS], slice_hist[HIST_BUCKETS];
+    static SpinLock stat_lock;
+
+    acquire_spinlock(&stat_lock); //*
 
-            // 该锁在swtch调用前获得
-            release_spinlock(&before->lock); //* before进程锁
+    for (int k = 0; k < HIST_BUCKETS; k++)
+        wait_hist[k] = slice_hist[k] = 0;
+
+    for (int i = 0; i < NCPU; i++) {
+        auto stat = &sched_stats[i];
+        u64 attempts = stat->picks + stat->steals + stat->idle_picks;
+
+        printk("sched: cpu %d: running %d, wakeups %llu, picks %llu, steals %llu, idle %llu\n", i,
+            cpus[i].sched.nr_running, stat->wakeups, stat->picks, stat->steals,
+            stat->idle_picks);
+        printk("sched: cpu %d: voluntary %llu, involuntary %llu, migrations %llu, balanced "
+               "%llu, rq len avg %llu max %d\n",
+            i, stat->voluntary, stat->involuntary, stat->migrations, stat->balanced,
+            attempts ? stat->rq_len_sum / attempts : 0, stat->rq_len_max);
+
+        for (int k = 0; k < HIST_BUCKETS; k++) {
+            wait_hist[k] += stat->wait_hist[k];
+            slice_hist[k] += stat->slice_hist[k];
         }
     }
+
+    __hist_print("wait-to-run latency", wait_hist);
+    __hist_print("time slice used", slice_hist);
+
+    for (int i = 0; i < NCPU; i++) {
+        char name[] = "rq0";
+        name[2] = (char)('0' + i);
+        spinlock_stat(name, &cpus[i].sched.rq.lock);
+    }
+
+    release_spinlock(&stat_lock); //*
 }
 
 // proc.c->start_proc 配置进程入口到这里
 u64 proc_entry(void (*entry)(u64), u64 arg)
 {
-    // 释放在sched()中获取的锁
-    release_spinlock(&thisproc()->lock); //** next进程锁
+    // 释放在sched()中获取的锁, 之后以开启中断的状态运行
+    thiscpu->lock_trap = true;
+    __switch_finish();
 
     // 设置返回地址为entry
     set_return_addr(entry);
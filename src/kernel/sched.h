@@ -10,6 +10,23 @@ bool activate_proc(Proc*);
 void acquire_sched();
 void release_sched();
 void sched(enum procstate new_state);
+void idle_wait();
+void check_resched();
+void cond_resched();
+
+void set_nice(Proc*, int nice);
+int get_nice(Proc*);
+int set_scheduler(Proc*, int policy, int prio);
+int get_scheduler(Proc*);
+int set_affinity(Proc*, u64 mask);
+u64 get_affinity(Proc*);
+#define SLEEP_MAX_NS (1ull << 62) // 睡眠时长的上限 (约146年), 超出时截断, 避免到期时刻溢出
+
+u64 sleep_ns(u64 ns);
+u64 sleep_ms(u64 ms);
+
+void init_sched_percpu();
+void sched_stat();
 u64 proc_entry(void (*entry)(u64), u64 arg);
 
 // 获取调度锁 并开始调度
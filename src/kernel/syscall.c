@@ -4,6 +4,7 @@
 #include <common/sem.h>
 #include <test/test.h>
 #include <aarch64/intrinsic.h>
+#include <driver/clock.h>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Woverride-init"
@@ -14,9 +15,177 @@ u64 syscall_myreport()
     return myreport(id);
 }
 
+#define PRIO_PROCESS 0 // setpriority/getpriority: who为pid
+
+// setpriority(which, who, niceval): 设置进程的nice值
+u64 syscall_setpriority()
+{
+    auto ctx = thisproc()->ucontext;
+    if (ctx->x0 != PRIO_PROCESS)
+        return -1;
+
+    auto p = get_proc(ctx->x1);
+    if (p == NULL)
+        return -1;
+
+    int ret = -1;
+    if (!p->idle) {
+        set_nice(p, (int)ctx->x2);
+        ret = 0;
+    }
+    put_proc(p);
+    return ret;
+}
+
+// getpriority(which, who): 返回 20-nice (1~40), 避免与错误返回值混淆 (同Linux)
+u64 syscall_getpriority()
+{
+    auto ctx = thisproc()->ucontext;
+    if (ctx->x0 != PRIO_PROCESS)
+        return -1;
+
+    auto p = get_proc(ctx->x1);
+    if (p == NULL)
+        return -1;
+
+    int ret = p->idle ? -1 : 20 - get_nice(p);
+    put_proc(p);
+    return ret;
+}
+
+// sched_setscheduler(pid, policy, param): param指向用户空间的 int sched_priority
+u64 syscall_sched_setscheduler()
+{
+    auto ctx = thisproc()->ucontext;
+    auto param = (int*)ctx->x2;
+    if (param == NULL)
+        return -1;
+
+    // 先读取用户内存, 再持有pid树锁
+    int prio = *param;
+    auto p = get_proc(ctx->x0);
+    if (p == NULL)
+        return -1;
+
+    int ret = p->idle ? -1 : set_scheduler(p, (int)ctx->x1, prio);
+    put_proc(p);
+    return ret;
+}
+
+// sched_getscheduler(pid): 返回进程的调度策略
+u64 syscall_sched_getscheduler()
+{
+    auto p = get_proc(thisproc()->ucontext->x0);
+    if (p == NULL)
+        return -1;
+
+    int ret = p->idle ? -1 : get_scheduler(p);
+    put_proc(p);
+    return ret;
+}
+
+// sched_setaffinity(pid, len, mask): mask指向用户空间的CPU位图 (取前len字节)
+u64 syscall_sched_setaffinity()
+{
+    auto ctx = thisproc()->ucontext;
+    auto user_mask = (u8*)ctx->x2;
+    usize len = ctx->x1;
+    if (user_mask == NULL)
+        return -1;
+
+    u64 mask = 0;
+    for (usize i = 0; i < len && i < sizeof(u64); i++)
+        mask |= (u64)user_mask[i] << (i * 8);
+
+    auto p = get_proc(ctx->x0);
+    if (p == NULL)
+        return -1;
+
+    int ret = p->idle ? -1 : set_affinity(p, mask);
+    put_proc(p);
+    return ret;
+}
+
+// sched_getaffinity(pid, len, mask): 写入CPU位图, 返回写入的字节数 (同Linux)
+u64 syscall_sched_getaffinity()
+{
+    auto ctx = thisproc()->ucontext;
+    auto user_mask = (u64*)ctx->x2;
+    if (user_mask == NULL || ctx->x1 < sizeof(u64))
+        return -1;
+
+    auto p = get_proc(ctx->x0);
+    if (p == NULL)
+        return -1;
+
+    bool idle = p->idle;
+    u64 mask = get_affinity(p);
+    put_proc(p);
+    if (idle)
+        return -1;
+
+    // 释放pid树锁后再写用户内存
+    *user_mask = mask;
+    return sizeof(u64);
+}
+
+struct timespec {
+    i64 tv_sec;  // 秒
+    i64 tv_nsec; // 纳秒 (0~999999999)
+};
+
+// nanosleep(req, rem): req/rem指向用户空间的 struct timespec
+// 睡满返回0; 被提前唤醒返回-1, 并在rem非空时写入剩余时间 (同Linux)
+// tv_sec或tv_nsec超出范围时返回-EINVAL; 过长的时长截断到SLEEP_MAX_NS, 相乘前先截断避免溢出
+u64 syscall_nanosleep()
+{
+    auto ctx = thisproc()->ucontext;
+    auto req = (struct timespec*)ctx->x0;
+    auto rem = (struct timespec*)ctx->x1;
+    if (req == NULL)
+        return -1;
+
+    i64 sec = req->tv_sec;
+    i64 nsec = req->tv_nsec;
+    if (sec < 0 || nsec < 0 || nsec >= (i64)NSEC_PER_SEC)
+        return -EINVAL;
+
+    if ((u64)sec > SLEEP_MAX_NS / NSEC_PER_SEC)
+        sec = SLEEP_MAX_NS / NSEC_PER_SEC;
+
+    u64 left = sleep_ns((u64)sec * NSEC_PER_SEC + (u64)nsec);
+    if (left == 0)
+        return 0;
+
+    if (rem != NULL) {
+        rem->tv_sec = left / NSEC_PER_SEC;
+        rem->tv_nsec = left % NSEC_PER_SEC;
+    }
+    return -1;
+}
+
+// sleep_ms(ms): 睡眠ms毫秒, 返回剩余的毫秒数 (被提前唤醒时非0)
+u64 syscall_sleep_ms() { return sleep_ms(thisproc()->ucontext->x0); }
+
+// schedstat(): 打印调度统计
+u64 syscall_schedstat()
+{
+    sched_stat();
+    return 0;
+}
+
 // 系统调用函数映射表
 static u64 (*syscall_table[NR_SYSCALL])(void) = {
     [0 ... NR_SYSCALL - 1] = NULL,
+    [SYS_nanosleep] = (void*)syscall_nanosleep,
+    [SYS_sched_setscheduler] = (void*)syscall_sched_setscheduler,
+    [SYS_sched_getscheduler] = (void*)syscall_sched_getscheduler,
+    [SYS_sched_setaffinity] = (void*)syscall_sched_setaffinity,
+    [SYS_sched_getaffinity] = (void*)syscall_sched_getaffinity,
+    [SYS_setpriority] = (void*)syscall_setpriority,
+    [SYS_getpriority] = (void*)syscall_getpriority,
+    [SYS_sleep_ms] = (void*)syscall_sleep_ms,
+    [SYS_schedstat] = (void*)syscall_schedstat,
     [SYS_myreport] = (void*)syscall_myreport,
 };
 
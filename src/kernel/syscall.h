@@ -3,4 +3,7 @@
 
 #define NR_SYSCALL 512
 
+// 错误码 (同Linux), 系统调用返回其相反数
+#define EINVAL 22
+
 void syscall_entry(UserContext *context);
\ No newline at end of file
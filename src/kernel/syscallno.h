@@ -1,3 +1,14 @@
 #pragma once
 
+// 调度相关 (与Linux aarch64编号一致)
+#define SYS_nanosleep 101
+#define SYS_sched_setscheduler 119
+#define SYS_sched_getscheduler 120
+#define SYS_sched_setaffinity 122
+#define SYS_sched_getaffinity 123
+#define SYS_setpriority 140
+#define SYS_getpriority 141
+
+#define SYS_sleep_ms 497  // 睡眠毫秒, 返回剩余的毫秒数
+#define SYS_schedstat 498 // 打印调度统计
 #define SYS_myreport 499
\ No newline at end of file
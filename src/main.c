@@ -9,8 +9,10 @@
 #include <driver/interrupt.h>
 #include <kernel/proc.h>
 #include <driver/gicv3.h>
+#include <driver/ipi.h>
 #include <driver/timer.h>
 #include <aarch64/mmu.h>
+#include <common/sem.h>
 
 static volatile bool boot_secondary_cpus = false;
 
@@ -22,6 +24,7 @@ void main()
         memset(edata, 0, (usize)(end - edata));
 
         init_interrupt(); // 初始化每种中断的处理函数
+        init_ipi();       // 初始化处理器间中断
 
         uart_init();   // 初始化终端 (UART)
         printk_init(); // 初始化printk
@@ -32,6 +35,7 @@ void main()
         init_clock_handler(); // 初始化定时器中断处理函数
 
         kinit(); // 初始化内核内存分配器
+        init_sem_cache(); // 初始化信号量等待体的对象缓存
 
         init_sched(); // 初始化调度器
         init_kproc(); // 初始化第一个内核进程 (root_proc)
@@ -6,8 +6,6 @@
 #include <kernel/printk.h>
 #include <test/test.h>
 
-extern RefCount kalloc_page_cnt;
-
 static void* p[4][10000];
 static short sz[4][10000];
 
@@ -36,7 +34,7 @@ void kalloc_test()
 {
 
     int i = cpuid(); // CPU编号
-    int r = kalloc_page_cnt.count;
+    int r = kalloc_page_cnt();
     int y = 10000 - i * 500;
 
     if (i == 0)
@@ -65,13 +63,60 @@ void kalloc_test()
     SYNC(2)
 #endif
 
-    if (kalloc_page_cnt.count != r) // 确保kalloc_page_cnt.count没有变化
-        FAIL("FAIL: kalloc_page_cnt %d -> %lld\n", r, kalloc_page_cnt.count);
+    if (kalloc_page_cnt() != r) // 确保kalloc_page_cnt()没有变化
+        FAIL("FAIL: kalloc_page_cnt %d -> %lld\n", r, kalloc_page_cnt());
 
 #ifndef SINGLE_CORE
     SYNC(3)
 #endif
 
+    // 混合阶数的连续页分配
+    for (int j = 0; j < 1000; j++) {
+        // 阶数服从几何分布: P(order=k) = 1/2^(k+1), 最大为9阶 (2MiB)
+        int order = __builtin_ctz(rand() | 512);
+        u64 len = (u64)PAGE_SIZE << order;
+
+        sz[i][j] = order;
+        p[i][j] = kalloc_pages(order);
+        if (!p[i][j] || ((u64)p[i][j] & (len - 1))) // 检查首地址是否按块大小对齐
+            FAIL("FAIL: kalloc_pages(%d) = %p\n", order, p[i][j]);
+        memset(p[i][j], i ^ j, len);
+
+        // 随机释放一部分, 制造碎片以测试伙伴合并
+        if (j > 0 && (rand() & 3) == 0) {
+            int k = rand() % j;
+            if (p[i][k] != NULL) {
+                kfree_pages(p[i][k], sz[i][k]);
+                p[i][k] = NULL;
+            }
+        }
+    }
+
+    for (int j = 0; j < 1000; j++) {
+        if (p[i][j] == NULL)
+            continue;
+        u8 m = (i ^ j) & 255;
+        u64 len = (u64)PAGE_SIZE << sz[i][j];
+        for (u64 k = 0; k < len; k += PAGE_SIZE / 4) // 抽查每个块的内容
+            if (((u8*)p[i][j])[k] != m)
+                FAIL("FAIL: pages[%d][%d] wrong\n", i, j);
+        kfree_pages(p[i][j], sz[i][j]);
+    }
+
+#ifndef SINGLE_CORE
+    SYNC(4)
+#endif
+
+    if (kalloc_page_cnt() != r)
+        FAIL("FAIL: kalloc_page_cnt %d -> %lld\n", r, kalloc_page_cnt());
+
+    if (i == 0)
+        kalloc_page_stat();
+
+#ifndef SINGLE_CORE
+    SYNC(5)
+#endif
+
     for (int j = 0; j < 10000;) {
         // 前1000次, 或者概率为 9/16
         if (j < 1000 || rand() > RAND_MAX / 16 * 7) {
@@ -154,7 +199,7 @@ void kalloc_test()
     }
 
 #ifndef SINGLE_CORE
-    SYNC(4)
+    SYNC(6)
 #endif
 
     if (cpuid() == 0) {
@@ -165,20 +210,58 @@ void kalloc_test()
                 z += sz[j][k];
             }
         // 打印总大小和当前页使用大小
-        printk("Total: %lld\nUsage: %lld\n", z, kalloc_page_cnt.count - r);
+        printk("Total: %lld\nUsage: %lld\n", z, kalloc_page_cnt() - r);
     }
 
 #ifndef SINGLE_CORE
-    SYNC(5)
+    SYNC(7)
 #endif
 
     for (int j = 0; j < 10000; j++)
         kfree(p[i][j]);
 
+    // 内存压力测试: 大量分配再全部释放后, 空Slab页应归还页分配器
+    kalloc_drain();
+
 #ifndef SINGLE_CORE
-    SYNC(6)
+    SYNC(8)
+#endif
+
+    for (int j = 0; j < 10000; j++) {
+        // 每64次分配一个大对象 z=[4097,32767], 其余 z=[1,2048]
+        if (j % 64 == 0)
+            sz[i][j] = rand() % 28671 + 4097;
+        else
+            sz[i][j] = rand() % 2048 + 1;
+        p[i][j] = kalloc(sz[i][j]);
+        memset(p[i][j], i ^ j, sz[i][j]);
+    }
+
+#ifndef SINGLE_CORE
+    SYNC(9)
 #endif
 
     if (cpuid() == 0)
+        printk("Pressure peak: %lld\n", kalloc_page_cnt() - r);
+
+#ifndef SINGLE_CORE
+    SYNC(10)
+#endif
+
+    for (int j = 0; j < 10000; j++)
+        kfree(p[i][j]);
+    kalloc_drain();
+
+#ifndef SINGLE_CORE
+    SYNC(11)
+#endif
+
+    if (cpuid() == 0) {
+        // 所有对象释放后, 12种分配器各自最多保留SLAB_RESERVE个空页
+        isize usage = kalloc_page_cnt() - r;
+        printk("Pressure after: %lld\n", usage);
+        if (usage > SLAB_RESERVE * 12)
+            FAIL("FAIL: %lld slab pages not returned\n", usage);
         printk("kalloc_test PASS\n");
+    }
 }
@@ -3,6 +3,10 @@
 #include <test/test.h>
 #include <kernel/mem.h>
 #include <kernel/printk.h>
+#include <kernel/cpu.h>
+#include <aarch64/intrinsic.h>
+#include <driver/clock.h>
+#include <driver/ipi.h>
 
 void set_parent_to_this(Proc* proc);
 
@@ -169,6 +173,189 @@ static void proc_test_1()
     exit(0); // 退出码为0
 }
 
+#define BENCH_ROUNDS 10000 // 乒乓往返次数
+#define BENCH_YIELDS 10000 // 每个进程的让出次数
+
+static Semaphore ping, pong;
+
+static void bench_ping(u64 n)
+{
+    for (u64 i = 0; i < n; i++) {
+        post_sem(&ping);
+        wait_sem(&pong);
+    }
+    exit(0);
+}
+
+static void bench_pong(u64 n)
+{
+    for (u64 i = 0; i < n; i++) {
+        wait_sem(&ping);
+        post_sem(&pong);
+    }
+    exit(0);
+}
+
+static void bench_yield(u64 n)
+{
+    for (u64 i = 0; i < n; i++)
+        yield();
+    exit(0);
+}
+
+#define BENCH_SLEEPS 100 // 睡眠精度测试的次数
+
+static void bench_sleep(u64 ns)
+{
+    thisproc()->schinfo.timer_slack = 0;
+    u64 over = 0;
+    for (int i = 0; i < BENCH_SLEEPS; i++) {
+        u64 t0 = get_timestamp();
+        ASSERT(sleep_ns(ns) == 0);
+        u64 slept = ticks_to_ns(get_timestamp() - t0);
+        ASSERT(slept + ticks_to_ns(1) >= ns);
+        over += slept > ns ? slept - ns : 0;
+    }
+    printk("sched_bench: sleep %llu ns, %llu ns late on average\n", ns, over / BENCH_SLEEPS);
+    exit(0);
+}
+
+#define BENCH_SLEEPERS 8 // 定时器合并测试的睡眠进程数
+#define BENCH_NAPS 200   // 每个睡眠进程的睡眠次数
+
+// 睡眠间隔互相错开几微秒, 没有延后范围时各自触发中断
+static void bench_sleeper(u64 slack)
+{
+    thisproc()->schinfo.timer_slack = slack;
+    u64 ns = 200000 + (u64)(thisproc()->pid % BENCH_SLEEPERS) * 7000;
+    for (int i = 0; i < BENCH_NAPS; i++)
+        sleep_ns(ns);
+    exit(0);
+}
+
+// 统计睡眠密集负载下每秒的定时器中断次数
+static void bench_slack(u64 slack)
+{
+    int code;
+    u64 irq0 = timer_irq_count();
+    u64 t0 = get_timestamp();
+    for (int i = 0; i < BENCH_SLEEPERS; i++)
+        start_proc(create_proc(), bench_sleeper, slack);
+    for (int i = 0; i < BENCH_SLEEPERS; i++)
+        wait(&code);
+    u64 t1 = get_timestamp();
+    u64 irqs = timer_irq_count() - irq0;
+    printk("sched_bench: timer slack %llu ns, %llu timer irqs/s\n", slack,
+        irqs * NSEC_PER_SEC / ticks_to_ns(t1 - t0));
+}
+
+// 上下文切换延迟测试
+// ping-pong: 两个进程通过信号量交替唤醒, 测量一次往返 (两次唤醒+切换)
+// yield: 每个CPU上两个进程互相让出, 测量一次让出 (一次切换)
+// sleep: 高精度定时器睡眠的平均超时
+// slack: 定时器不合并/合并时的中断频率
+void sched_bench()
+{
+    int code;
+    printk("sched_bench\n");
+
+    init_sem(&ping, 0);
+    init_sem(&pong, 0);
+
+    u64 t0 = get_timestamp();
+    start_proc(create_proc(), bench_ping, BENCH_ROUNDS);
+    start_proc(create_proc(), bench_pong, BENCH_ROUNDS);
+    for (int i = 0; i < 2; i++)
+        wait(&code);
+    u64 t1 = get_timestamp();
+    printk("sched_bench: ping-pong %llu ns per round trip\n",
+        ticks_to_ns(t1 - t0) / BENCH_ROUNDS);
+
+    t0 = get_timestamp();
+    for (int i = 0; i < 2 * NCPU; i++)
+        start_proc(create_proc(), bench_yield, BENCH_YIELDS);
+    for (int i = 0; i < 2 * NCPU; i++)
+        wait(&code);
+    t1 = get_timestamp();
+    printk("sched_bench: yield %llu ns per switch\n",
+        ticks_to_ns(t1 - t0) * NCPU / (2 * NCPU * BENCH_YIELDS));
+
+    start_proc(create_proc(), bench_sleep, 50000);
+    wait(&code);
+    start_proc(create_proc(), bench_sleep, 1000000);
+    wait(&code);
+
+    bench_slack(0);
+    bench_slack(50000);
+}
+
+static Semaphore s7;
+
+static void sem_timeout_poster(u64 ms)
+{
+    sleep_ms(ms);
+    post_sem(&s7);
+    exit(0);
+}
+
+// 超时等待: 超时返回false, 超时前被post返回true, 已有信号量时立即返回true
+static void sem_timeout_test()
+{
+    int code;
+    init_sem(&s7, 0);
+
+    u64 t0 = get_timestamp();
+    ASSERT(!wait_sem_timeout(&s7, 2000000));
+    ASSERT(ticks_to_ns(get_timestamp() - t0) >= 2000000);
+
+    start_proc(create_proc(), sem_timeout_poster, 2);
+    t0 = get_timestamp();
+    ASSERT(wait_sem_timeout(&s7, 1000 * 1000000ull));
+    ASSERT(ticks_to_ns(get_timestamp() - t0) < 1000 * 1000000ull);
+    wait(&code);
+
+    post_sem(&s7);
+    ASSERT(wait_sem_timeout(&s7, 0));
+    ASSERT(!wait_sem_timeout(&s7, 0));
+    ASSERT(_query_sem(&s7) == 0);
+
+    printk("sem_timeout_test PASS\n");
+}
+
+static u64 ipi_ran;
+
+static void ipi_test_func(u64 arg)
+{
+    ASSERT(arg == 42);
+    __atomic_fetch_or(&ipi_ran, BIT(cpuid()), __ATOMIC_RELAXED);
+}
+
+// 跨CPU调用: 每个在线CPU恰好执行一次, 返回值与实际执行的CPU一致
+static void ipi_call_test()
+{
+    u64 online = 0;
+    for (int i = 0; i < NCPU; i++)
+        if (cpus[i].online)
+            online |= BIT(i);
+
+    ipi_ran = 0;
+    u64 ran = ipi_call(BIT(NCPU) - 1, ipi_test_func, 42);
+    ASSERT(ran == online);
+    ASSERT(__atomic_load_n(&ipi_ran, __ATOMIC_RELAXED) == online);
+
+    // 只调用其他CPU
+    ipi_ran = 0;
+    bool trap = _arch_disable_trap(); //*
+    u64 others = online & ~BIT(cpuid());
+    ran = ipi_call(others, ipi_test_func, 42);
+    if (trap)
+        _arch_enable_trap(); //*
+    ASSERT(ran == others);
+    ASSERT(__atomic_load_n(&ipi_ran, __ATOMIC_RELAXED) == others);
+
+    printk("ipi_call_test PASS\n");
+}
+
 void proc_test()
 {
     printk("proc_test\n");
@@ -189,5 +376,11 @@ void proc_test()
             t |= 1 << (code - 20);
     }
     ASSERT(t == 1048575);
+    sem_timeout_test();
+    ipi_call_test();
+    sched_bench();
+    sched_stat();
+    timer_stat();
+    kalloc_profile_dump();
     printk("proc_test PASS\n");
 }
@@ -6,6 +6,7 @@
 void kalloc_test();
 void rbtree_test();
 void proc_test();
+void sched_bench();
 void vm_test();
 void user_proc_test();
 unsigned rand();
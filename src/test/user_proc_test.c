@@ -18,8 +18,7 @@ void vm_test()
     static void* p[100000];
 
     // 记录当前已分配的页数
-    extern RefCount kalloc_page_cnt;
-    int p0 = kalloc_page_cnt.count;
+    int p0 = kalloc_page_cnt();
 
     // 创建并初始化空页表
     struct pgdir pg;
@@ -59,7 +58,7 @@ void vm_test()
         kfree_page(p[i]);
 
     // 确保使用的所有页都被释放
-    ASSERT(kalloc_page_cnt.count == p0);
+    ASSERT(kalloc_page_cnt() == p0);
     printk("vm_test PASS\n");
 }
 